@@ -2,23 +2,108 @@
 #include <allocator.h>
 #include <printf.h>
 #include <halt.h>
+#include <smp.h>
+#include <bitops.h>
+#include <memblock.h>
 
 #define NUM_BUDDY_LISTS 32
+#define BITMAP_WORDS(bits) (((bits) + 63) / 64)
 
-static int __reserve_page(void*addr);
-static int __reserve_pages(void* addr, size_t num_pages);
-static int __unreserve_page(void*addr);
-static int __unreserve_pages(void* addr, size_t num_pages);
+/* default per-CPU page cache tuning */
+#define PCP_LOW 0
+#define PCP_HIGH 96
+#define PCP_BATCH 16
+
+/* pages that may wait unmerged before everything is coalesced */
+#define LAZY_HIGH 256
+
+/* run the shrinkers from the timer tick once the buddy lists hold fewer pages than this */
+#define SHRINK_LOW 1024
+
+/* pre-zeroed page pool size, and pages zeroed per timer tick */
+#define ZERO_POOL_HIGH 64
+#define ZERO_POOL_BATCH 4
 
 /* information about all page frames */
-static page_properties_t properties_ptr = {0, NULL};
+static page_properties_t properties_ptr = {0, NULL, NULL, NULL};
+static uint64_t free_memory = 0; //bytes of mapped memory neither in use nor reserved
+static uint64_t used_memory = 0;
+
+static uint64_t offset; //physical address of the first page frame managed by the buddy system
+static size_t buddy_frames; //number of page frames covered by the buddy metadata
+static size_t num_buddy_meta_pages;
+
+/* physical memory zones; a zone starts where the previous one ends */
+static const uint64_t zone_start[NUM_ZONES] = {0, ZONE_DMA32_LIMIT};
+static const char* zone_names[NUM_ZONES] = {"DMA32", "Normal"};
+static size_t zone_free_pages[NUM_ZONES];
+
+static list_t buddy_lists[NUM_ZONES][NUM_MIGRATE_TYPES][NUM_BUDDY_LISTS];
+static size_t free_block_count[NUM_BUDDY_LISTS]; //free blocks of each order, all zones and kinds
+
+/* mobility of each pageblock; a free block sits on the list of its first pageblock's kind */
+static uint8_t* pageblock_types;
+static const char* migrate_names[NUM_MIGRATE_TYPES] = {"Unmovable", "Reclaimable", "Movable"};
+/* kinds to borrow from, in order, once a kind's own pageblocks are exhausted */
+static const int migrate_fallbacks[NUM_MIGRATE_TYPES][NUM_MIGRATE_TYPES - 1] = {
+    [MIGRATE_UNMOVABLE] = {MIGRATE_RECLAIMABLE, MIGRATE_MOVABLE},
+    [MIGRATE_RECLAIMABLE] = {MIGRATE_UNMOVABLE, MIGRATE_MOVABLE},
+    [MIGRATE_MOVABLE] = {MIGRATE_RECLAIMABLE, MIGRATE_UNMOVABLE},
+};
+static size_t mobility_fallbacks; //allocations served from another kind's pageblocks
+static size_t pageblocks_claimed; //pageblocks that changed kind
+
+/* per-CPU cache of single pages, hot pages at the front and cold ones at the back */
+typedef struct pcp_cache {
+    list_t pages;
+    size_t count;
+    size_t hits;
+    size_t misses;
+    size_t refills;
+    size_t drains;
+} pcp_cache_t;
+
+static pcp_cache_t pcp_caches[MAX_CPUS];
+static size_t pcp_low = PCP_LOW; //refill once an allocation finds this many pages or fewer
+static size_t pcp_high = PCP_HIGH; //drain once a free leaves more pages than this
+static size_t pcp_batch = PCP_BATCH; //pages moved per refill / drain
+
+/* freed blocks waiting to be merged, per mobility and order, linked through their first bytes */
+static list_t lazy_lists[NUM_MIGRATE_TYPES][NUM_BUDDY_LISTS];
+static size_t lazy_pages; //pages on the unmerged lists
+static size_t lazy_high = LAZY_HIGH; //coalesce everything above this many pages, 0 merges on free
+static size_t lazy_deferred; //frees that skipped merging
+static size_t lazy_reused; //allocations served unmerged, each avoiding a merge and a split
+static size_t lazy_flushes;
+
+/* callbacks that give cached memory back under pressure */
+static shrinker_fn_t shrinkers[MAX_SHRINKERS];
+static size_t num_shrinkers = 0;
+static size_t shrinker_runs;
+static size_t shrinker_pages; //pages the shrinkers gave back
+
+/* single pages zeroed ahead of time, linked through their first bytes */
+static list_t zeroed_pages;
+static size_t zeroed_count;
+static size_t zeroed_hits;
+static size_t zeroed_misses;
+
+#if BUDDY_BITMAP
+/* one bit per buddy pair and order, set while exactly one of the pair is free */
+static uint64_t* buddy_bitmap;
+static size_t buddy_bitmap_index[NUM_BUDDY_LISTS]; //first word of each order's bitmap
+/* per page frame: order + 1 of the allocated block starting there, 0 otherwise */
+static uint8_t* buddy_orders;
+#else
+/* buddy descriptors: a pool handed out bump-style, recycled through a free stack */
 static buddy_block_t* buddy_pool;
-static int free_memory = 0;
-static int used_memory = 0;
-static size_t num_buddy_pages;
-static uint64_t offset;
+static size_t buddy_pool_size;
+static size_t buddy_pool_next;
+static buddy_block_t* buddy_stack;
 
-static list_t buddy_lists[NUM_BUDDY_LISTS];
+/* page frame (relative to offset) -> descriptor of the block starting at that frame */
+static buddy_block_t** buddy_map;
+#endif
 
 /**
  * ####################
@@ -34,151 +119,917 @@ static size_t pages_to_buddy_index(size_t num_pages){
     return i - 1;
 }
 
-/* Find the first free buddy then allocate him*/
-static buddy_block_t* __request_buddy(){
-    uint64_t i;
+/* Smallest list index whose blocks can hold num_pages */
+static size_t pages_to_order(size_t num_pages){
+    if (num_pages <= 1) return 0;
+    return pages_to_buddy_index(num_pages - 1) + 1;
+}
 
-    for (i = 0; i < num_buddy_pages * (PAGESIZE / sizeof(buddy_block_t)); i++){
-        if (buddy_pool[i].physical_addr != 0) continue; //skip if in use
-        return (buddy_block_t*) (buddy_pool + i);
+/* Page frame of a physical address, relative to the start of the buddy system */
+static inline uint64_t __buddy_frame(uint64_t addr){
+    return (addr - offset) >> PAGESHIFT;
+}
+
+/* Address of the buddy of the block at addr */
+static inline uint64_t __buddy_pair(uint64_t addr, size_t order){
+    return ((addr - offset) ^ (PAGESIZE << order)) + offset;
+}
+
+/* Zone a physical address belongs to */
+static inline int __addr_zone(uint64_t addr){
+    return addr < ZONE_DMA32_LIMIT ? ZONE_DMA32 : ZONE_NORMAL;
+}
+
+/* Pages needed for the pageblock mobility table */
+static size_t __pageblock_meta_pages(size_t frames){
+    return ((frames >> PAGEBLOCK_ORDER) + 1) / PAGESIZE + 1;
+}
+
+/* Mobility of the pageblock holding addr */
+static inline int __block_type(uint64_t addr){
+    return pageblock_types[__buddy_frame(addr) >> PAGEBLOCK_ORDER];
+}
+
+/* Hand every pageblock covered by a free block of the given order to migrate_type */
+static void __claim_pageblocks(uint64_t addr, size_t order, int migrate_type){
+    uint64_t pb = __buddy_frame(addr) >> PAGEBLOCK_ORDER;
+    uint64_t last = pb + (1ULL << (order - PAGEBLOCK_ORDER));
+
+    for(; pb < last; pb++){
+        if(pageblock_types[pb] != migrate_type){
+            pageblock_types[pb] = migrate_type;
+            pageblocks_claimed++;
+        }
     }
-    return NULL;
 }
 
-/* Find a buddy assigned to the corresponding physical address */
-static buddy_block_t* __find_buddy(void* physical_address){
-    uint64_t i;
-    uint64_t addr = (uint64_t)physical_address;
+/* Free list a block starting at addr belongs on */
+static inline list_t* __free_list(uint64_t addr, size_t order){
+    return &buddy_lists[__addr_zone(addr)][__block_type(addr)][order];
+}
+
+#if BUDDY_BITMAP
+/**
+ * Bitmap engine: free blocks are linked through a list_elem_t stored in the
+ * first bytes of the free page itself, and the only per-block state is the
+ * pair bit (flipped each time either buddy enters or leaves a free list).
+ */
+
+/* Pages needed for the pair bitmaps and the order map */
+static size_t __buddy_meta_pages(size_t frames){
+    size_t words = 0;
+    for (size_t i = 0; i < NUM_BUDDY_LISTS; i++)
+        words += (frames >> (i + 1)) / 64 + 1;
+    return (words * sizeof(uint64_t) + frames * sizeof(uint8_t)) / PAGESIZE + 1;
+}
+
+static void __buddy_meta_init(void* base, size_t frames){
+    size_t words = 0;
+    buddy_bitmap = (uint64_t*)base;
+    for (size_t i = 0; i < NUM_BUDDY_LISTS; i++){
+        buddy_bitmap_index[i] = words;
+        words += (frames >> (i + 1)) / 64 + 1;
+    }
+    buddy_orders = (uint8_t*)(buddy_bitmap + words);
+}
+
+/* Flip the pair bit of the block at addr. Returns the new value */
+static inline int __toggle_pair(uint64_t addr, size_t order){
+    uint64_t pair = __buddy_frame(addr) >> (order + 1);
+    uint64_t* word = &buddy_bitmap[buddy_bitmap_index[order] + pair / 64];
+    *word ^= 1ULL << (pair % 64);
+    return (*word >> (pair % 64)) & 1;
+}
+
+static inline uint64_t __elem_addr(list_elem_t* e){
+    return (uint64_t)e;
+}
+
+/* order map entries of free block heads carry this flag, allocated heads hold order + 1 */
+#define BUDDY_ORDER_FREE 0x80
+
+static void __push_free(uint64_t addr, size_t order){
+    __toggle_pair(addr, order);
+    buddy_orders[__buddy_frame(addr)] = BUDDY_ORDER_FREE | order;
+    list_push_back(__free_list(addr, order), (list_elem_t*)addr);
+    free_block_count[order]++;
+}
+
+static void __unlink_free(uint64_t addr, size_t order){
+    __toggle_pair(addr, order);
+    buddy_orders[__buddy_frame(addr)] = 0;
+    list_remove((list_elem_t*)addr);
+    free_block_count[order]--;
+}
+
+static uint64_t __pop_free(int zone, int migrate_type, size_t order){
+    uint64_t addr = (uint64_t)list_pop_front(&buddy_lists[zone][migrate_type][order]);
+    __toggle_pair(addr, order);
+    buddy_orders[__buddy_frame(addr)] = 0;
+    free_block_count[order]--;
+    return addr;
+}
+
+/* Is the buddy of the (not free) block at addr free at the same order? */
+static inline int __buddy_is_free(uint64_t addr, size_t order){
+    uint64_t pair = __buddy_frame(addr) >> (order + 1);
+    return (buddy_bitmap[buddy_bitmap_index[order] + pair / 64] >> (pair % 64)) & 1;
+}
+
+static void __set_alloc_order(uint64_t addr, size_t order){
+    buddy_orders[__buddy_frame(addr)] = order + 1;
+}
+
+/* Order of the allocated block starting at addr, -1 if there is none */
+static int __get_alloc_order(uint64_t addr){
+    if (addr < offset || __buddy_frame(addr) >= buddy_frames || buddy_orders[__buddy_frame(addr)] & BUDDY_ORDER_FREE)
+        return -1;
+    return (int)buddy_orders[__buddy_frame(addr)] - 1;
+}
+
+/* Order of the free block starting at addr, -1 if there is none */
+static int __get_free_order(uint64_t addr){
+    if (addr < offset || __buddy_frame(addr) >= buddy_frames || !(buddy_orders[__buddy_frame(addr)] & BUDDY_ORDER_FREE))
+        return -1;
+    return buddy_orders[__buddy_frame(addr)] & ~BUDDY_ORDER_FREE;
+}
+
+static void __clear_alloc(uint64_t addr){
+    buddy_orders[__buddy_frame(addr)] = 0;
+}
+
+#else
+/**
+ * Descriptor engine: every free or allocated block head owns a buddy_block_t,
+ * reachable from its page frame through buddy_map.
+ */
+
+/* Pages needed for the descriptor pool and the frame table */
+static size_t __buddy_meta_pages(size_t frames){
+    return frames * (sizeof(buddy_block_t) + sizeof(buddy_block_t*)) / PAGESIZE + 1;
+}
+
+static void __buddy_meta_init(void* base, size_t frames){
+    buddy_map = (buddy_block_t**)base;
+    buddy_pool = (buddy_block_t*)(buddy_map + frames);
+    buddy_pool_size = frames;
+    buddy_pool_next = 0;
+    buddy_stack = NULL;
+}
+
+/* Pop an unused descriptor off the free stack (or the untouched part of the pool) */
+static buddy_block_t* __request_buddy(){
+    buddy_block_t* blk = buddy_stack;
 
-    for (i = 0; i < num_buddy_pages * (PAGESIZE / sizeof(buddy_block_t)); i++){
-        if (buddy_pool[i].physical_addr == addr)
-            return (buddy_block_t*) (buddy_pool + i);
+    if (blk){
+        buddy_stack = (buddy_block_t*)blk->elem.next;
+        return blk;
     }
+    if (buddy_pool_next < buddy_pool_size)
+        return buddy_pool + buddy_pool_next++;
+    HALT("[!] Failed to get buddy struct from pool!\n");
     return NULL;
 }
 
-/* Initialize buddy system with segment of memory */
-static int init_buddy(void* addr, size_t total_mem_num_pages){
-    uint64_t i;
-    size_t list_index;
-    buddy_block_t* blk;
-    size_t remaining_pages = total_mem_num_pages;
-    offset = (uint64_t)addr;
+/* Return a descriptor to the free stack */
+static void __release_buddy(buddy_block_t* blk){
+    buddy_map[__buddy_frame(blk->physical_addr)] = NULL;
+    blk->physical_addr = 0;
+    blk->size = 0;
+    blk->free = 0;
+    blk->elem.next = (list_elem_t*)buddy_stack;
+    buddy_stack = blk;
+}
+
+/* Find the descriptor of the block starting at the corresponding physical address */
+static buddy_block_t* __find_buddy(uint64_t addr){
+    if (addr < offset || __buddy_frame(addr) >= buddy_frames)
+        return NULL;
+    return buddy_map[__buddy_frame(addr)];
+}
+
+/* Attach a fresh descriptor to the block starting at addr */
+static buddy_block_t* __new_buddy(uint64_t addr, size_t order, int free){
+    buddy_block_t* blk = __request_buddy();
+    blk->physical_addr = addr;
+    blk->size = 1ULL << order;
+    blk->free = free;
+    buddy_map[__buddy_frame(addr)] = blk;
+    return blk;
+}
+
+static inline uint64_t __elem_addr(list_elem_t* e){
+    return list_entry(e, buddy_block_t, elem)->physical_addr;
+}
+
+static void __push_free(uint64_t addr, size_t order){
+    list_push_back(__free_list(addr, order), &__new_buddy(addr, order, 1)->elem);
+    free_block_count[order]++;
+}
+
+static void __unlink_free(uint64_t addr, size_t order){
+    buddy_block_t* blk = __find_buddy(addr);
+    list_remove(&blk->elem);
+    __release_buddy(blk);
+    free_block_count[order]--;
+}
+
+static uint64_t __pop_free(int zone, int migrate_type, size_t order){
+    buddy_block_t* blk = list_entry(list_pop_front(&buddy_lists[zone][migrate_type][order]), buddy_block_t, elem);
+    uint64_t addr = blk->physical_addr;
+    __release_buddy(blk);
+    free_block_count[order]--;
+    return addr;
+}
+
+/* Is the buddy of the (not free) block at addr free at the same order? */
+static inline int __buddy_is_free(uint64_t addr, size_t order){
+    buddy_block_t* buddy = __find_buddy(__buddy_pair(addr, order));
+    return buddy && buddy->free && buddy->size == 1ULL << order;
+}
+
+static void __set_alloc_order(uint64_t addr, size_t order){
+    __new_buddy(addr, order, 0);
+}
+
+/* Order of the allocated block starting at addr, -1 if there is none */
+static int __get_alloc_order(uint64_t addr){
+    buddy_block_t* blk = __find_buddy(addr);
+    if (!blk || blk->free)
+        return -1;
+    return pages_to_buddy_index(blk->size);
+}
+
+/* Order of the free block starting at addr, -1 if there is none */
+static int __get_free_order(uint64_t addr){
+    buddy_block_t* blk = __find_buddy(addr);
+    if (!blk || !blk->free)
+        return -1;
+    return pages_to_buddy_index(blk->size);
+}
+
+static void __clear_alloc(uint64_t addr){
+    __release_buddy(__find_buddy(addr));
+}
+#endif
+
+/* Initialize buddy system covering num_frames page frames from base, with the
+ * pageblock mobility table at pageblocks */
+static int init_buddy(uint64_t base, size_t num_frames, uint8_t* pageblocks){
+    uint64_t i, j, k;
+
+    offset = base;
+    buddy_frames = num_frames;
+
+    // free memory starts out movable; kernel allocations claim pageblocks as they need them
+    pageblock_types = pageblocks;
+    for (i = 0; i <= num_frames >> PAGEBLOCK_ORDER; i++) pageblock_types[i] = MIGRATE_MOVABLE;
 
     // init all lists
-    for (i = 0; i < NUM_BUDDY_LISTS; i++) list_init(&buddy_lists[i]);
+    for (i = 0; i < NUM_ZONES; i++){
+        zone_free_pages[i] = 0;
+        for (j = 0; j < NUM_MIGRATE_TYPES; j++)
+            for (k = 0; k < NUM_BUDDY_LISTS; k++) list_init(&buddy_lists[i][j][k]);
+    }
+    for (j = 0; j < NUM_MIGRATE_TYPES; j++)
+        for (k = 0; k < NUM_BUDDY_LISTS; k++) list_init(&lazy_lists[j][k]);
+    lazy_pages = 0;
+    for (i = 0; i < NUM_BUDDY_LISTS; i++) free_block_count[i] = 0;
+    for (i = 0; i < MAX_CPUS; i++) list_init(&pcp_caches[i].pages);
+    list_init(&zeroed_pages);
+    zeroed_count = 0;
+    return 0;
+}
+
+/* Free a block of the given order, merging it with its buddy for as long as it is free and whole */
+static void __free_one(uint64_t blk, size_t list_index){
+    uint64_t pair_addr;
+
+    zone_free_pages[__addr_zone(blk)] += 1ULL << list_index;
+    for(; list_index < NUM_BUDDY_LISTS - 1; list_index++){
+        pair_addr = __buddy_pair(blk, list_index);
+        if(__addr_zone(pair_addr) != __addr_zone(blk) || !__buddy_is_free(blk, list_index))
+            break;
+
+        __unlink_free(pair_addr, list_index);
+        if(pair_addr < blk)
+            blk = pair_addr;
+    }
+    __push_free(blk, list_index);
+}
 
-    // place the inital memory block in the corresponding list
-    list_index = pages_to_buddy_index(remaining_pages);
-    if (remaining_pages < 1 << list_index){
-        // account for overshoot
+/* Order of the largest aligned block starting at addr that fits in num_pages */
+static size_t __range_piece(uint64_t addr, size_t num_pages){
+    size_t list_index = pages_to_buddy_index(num_pages);
+    uint64_t frame = __buddy_frame(addr);
+
+    if(frame && __builtin_ctzll(frame) < list_index)
+        list_index = __builtin_ctzll(frame);
+    if(list_index > NUM_BUDDY_LISTS - 1)
+        list_index = NUM_BUDDY_LISTS - 1;
+    // blocks never straddle a zone boundary
+    while(__addr_zone(addr) != __addr_zone(addr + (PAGESIZE << list_index) - 1))
         list_index--;
+    return list_index;
+}
+
+/* Hand a page aligned range to the buddy system as maximal aligned power-of-two blocks */
+static void __free_range(uint64_t addr, size_t num_pages){
+    size_t list_index;
+
+    while(num_pages){
+        list_index = __range_piece(addr, num_pages);
+        __free_one(addr, list_index);
+        addr += PAGESIZE << list_index;
+        num_pages -= 1ULL << list_index;
     }
+}
 
-    // add big chunk to list
-    if(!(blk = __request_buddy()))
-        HALT("[!] Failed to initialize buddy!\n");
+/**
+ * Cut a run of up to max blocks of the given order out of the free block of order i at addr,
+ * just taken off a zone's from list. The block is first halved down to a pageblock (or the order
+ * asked for, if bigger), the upper halves going back to the lists of their own kind; the
+ * pageblock cut from then changes hands to migrate_type, so the tail of the run stays
+ * grouped with the allocation. *num gets the length of the run
+ */
+static uint64_t __take_run(int zone, int from, int migrate_type, uint64_t addr, size_t i, size_t list_index, size_t max, size_t* num){
+    size_t k, pieces;
+    size_t keep = list_index > PAGEBLOCK_ORDER ? list_index : PAGEBLOCK_ORDER;
+
+    if(from != migrate_type)
+        mobility_fallbacks++;
+    while(i > keep){
+        i--;
+        __push_free(addr + (PAGESIZE << i), i);
+    }
+    zone_free_pages[zone] -= 1ULL << i;
+    if(i >= PAGEBLOCK_ORDER)
+        __claim_pageblocks(addr, i, migrate_type);
+
+    pieces = 1ULL << (i - list_index);
+    *num = pieces < max ? pieces : max;
+    for(k = 0; k < *num; k++)
+        __set_alloc_order(addr + k * (PAGESIZE << list_index), list_index);
+    if(*num < pieces)
+        __free_range(addr + *num * (PAGESIZE << list_index), (pieces - *num) << list_index);
+    return addr;
+}
 
-    // set attributes
-    blk->physical_addr = (uint64_t)addr;
-    blk->size = 1 << list_index;
+/**
+ * Take a run of up to max blocks of the given order for migrate_type out of a zone: from
+ * its own pageblocks first, then borrowing the largest block another kind has, so a whole
+ * pageblock gets claimed rather than many being polluted. Returns 0 when the zone is exhausted
+ */
+static uint64_t __alloc_run_zone(int zone, int migrate_type, size_t list_index, size_t max, size_t* num){
+    size_t i;
+    int j, fallback;
 
-    // insert
-    list_insert(list_tail(&buddy_lists[list_index]), &blk->elem);
+    for(i = list_index; i < NUM_BUDDY_LISTS; i++){
+        if(!list_empty(&buddy_lists[zone][migrate_type][i]))
+            return __take_run(zone, migrate_type, migrate_type, __pop_free(zone, migrate_type, i), i, list_index, max, num);
+    }
+    for(j = 0; j < NUM_MIGRATE_TYPES - 1; j++){
+        fallback = migrate_fallbacks[migrate_type][j];
+        for(i = NUM_BUDDY_LISTS; i-- > list_index;){
+            if(!list_empty(&buddy_lists[zone][fallback][i]))
+                return __take_run(zone, fallback, migrate_type, __pop_free(zone, fallback, i), i, list_index, max, num);
+        }
+    }
+    *num = 0;
+    return 0;
+}
 
-    // update remaining pages and move address to match
-    remaining_pages -= 1 << list_index;
-    addr += (1 << list_index) / 8 * PAGESIZE;
+/* Unconstrained run allocation, falling back from the Normal zone to DMA32 */
+static uint64_t __alloc_run(int migrate_type, size_t list_index, size_t max, size_t* num){
+    uint64_t addr = 0;
+    int zone;
 
+    for(zone = NUM_ZONES - 1; zone >= 0 && !addr; zone--)
+        addr = __alloc_run_zone(zone, migrate_type, list_index, max, num);
+    return addr;
+}
+
+/* Take a block of the given order off the free lists. Returns 0 when none is left */
+static uint64_t __alloc_one(int migrate_type, size_t list_index){
+    size_t num;
+    return __alloc_run(migrate_type, list_index, 1, &num);
+}
+
+/* Number of pages free on the buddy lists of all zones */
+static size_t __zone_free_total(){
+    size_t i, free_pages = 0;
+
+    for(i = 0; i < NUM_ZONES; i++)
+        free_pages += zone_free_pages[i];
+    return free_pages;
+}
 
+/* Merge every deferred block back into the buddy lists. Returns the pages released */
+static size_t __lazy_flush(){
+    size_t i, flushed = lazy_pages;
+    uint64_t addr;
+    int t;
+
+    if(!lazy_pages)
+        return 0;
+    lazy_flushes++;
+    for(t = 0; t < NUM_MIGRATE_TYPES; t++){
+        for(i = 0; i < NUM_BUDDY_LISTS; i++){
+            while(!list_empty(&lazy_lists[t][i])){
+                addr = (uint64_t)list_pop_front(&lazy_lists[t][i]);
+                __clear_alloc(addr);
+                __free_one(addr, i);
+            }
+        }
+    }
+    lazy_pages = 0;
+    return flushed;
+}
+
+/**
+ * Free a block without merging it: it stays marked allocated, so its buddy cannot merge
+ * with it, and waits on the unmerged list of its order for a request of the same size.
+ * Everything is merged once more than lazy_high pages are waiting
+ */
+static void __lazy_free(uint64_t blk, size_t list_index){
+    if(!lazy_high){
+        __clear_alloc(blk);
+        __free_one(blk, list_index);
+        return;
+    }
+    list_push_front(&lazy_lists[__block_type(blk)][list_index], (list_elem_t*)blk);
+    lazy_pages += 1ULL << list_index;
+    lazy_deferred++;
+    if(lazy_pages > lazy_high)
+        __lazy_flush();
+}
+
+/* Reuse an unmerged block of the given order and mobility, 0 if none is waiting */
+static uint64_t __lazy_alloc(int migrate_type, size_t list_index){
+    if(list_empty(&lazy_lists[migrate_type][list_index]))
+        return 0;
+    lazy_pages -= 1ULL << list_index;
+    lazy_reused++; // a merge on free and a split on this allocation avoided
+    return (uint64_t)list_pop_front(&lazy_lists[migrate_type][list_index]);
+}
+
+/* Move up to count pages from the buddy lists into a CPU's cache */
+static void __pcp_refill(pcp_cache_t* pcp, size_t count){
+    size_t k, num;
+    uint64_t addr;
+
+    pcp->refills++;
+    while(count && (addr = __alloc_run(MIGRATE_UNMOVABLE, 0, count, &num))){
+        for(k = 0; k < num; k++)
+            list_push_back(&pcp->pages, (list_elem_t*)(addr + k * PAGESIZE));
+        pcp->count += num;
+        count -= num;
+    }
+}
+
+/* Return up to count of the coldest pages of a CPU's cache to the buddy lists */
+static void __pcp_drain(pcp_cache_t* pcp, size_t count){
+    uint64_t addr;
+
+    pcp->drains++;
+    while(count-- && pcp->count){
+        addr = (uint64_t)list_pop_back(&pcp->pages);
+        pcp->count--;
+        __clear_alloc(addr);
+        __free_one(addr, 0);
+    }
+}
+
+/* Ask every registered shrinker for memory. Returns the pages they gave back */
+static size_t __run_shrinkers(){
+    size_t i, released = 0;
+
+    if(!num_shrinkers)
+        return 0;
+    shrinker_runs++;
+    for(i = 0; i < num_shrinkers; i++)
+        released += shrinkers[i]();
+    shrinker_pages += released;
+    return released;
+}
+
+/* Run the shrinkers, then give back the pages held by the zeroed pool, every CPU's cache and
+ * the unmerged lists, so they can merge into larger blocks again. Returns the pages released */
+static size_t __drain_caches(){
+    size_t i, drained = __run_shrinkers(); // freed slabs may land on the lists below
+    uint64_t addr;
+
+    drained += zeroed_count + __lazy_flush();
+    while(zeroed_count){
+        addr = (uint64_t)list_pop_front(&zeroed_pages);
+        zeroed_count--;
+        __clear_alloc(addr);
+        __free_one(addr, 0);
+    }
+    for(i = 0; i < MAX_CPUS; i++){
+        drained += pcp_caches[i].count;
+        if(pcp_caches[i].count)
+            __pcp_drain(&pcp_caches[i], pcp_caches[i].count);
+    }
+    return drained;
+}
+
+/* Register a callback that frees cached memory when the buddy system runs short. Return 0 on success */
+int register_shrinker(shrinker_fn_t fn){
+    if(num_shrinkers == MAX_SHRINKERS)
+        return 1;
+    shrinkers[num_shrinkers++] = fn;
     return 0;
 }
 
-/* Add a buddy block to the correct list */
-void __add_block(buddy_block_t* blk){
-    size_t list_index = pages_to_buddy_index(blk->size);
-    list_push_back(&buddy_lists[list_index], &blk->elem);
+/* Single page allocation, served from this CPU's cache */
+static uint64_t __pcp_alloc(){
+    pcp_cache_t* pcp = &pcp_caches[this_cpu()];
+
+    if(pcp->count > pcp_low)
+        pcp->hits++;
+    else{
+        pcp->misses++;
+        __pcp_refill(pcp, pcp_batch);
+        if(!pcp->count)
+            return 0;
+    }
+    pcp->count--;
+    return (uint64_t)list_pop_front(&pcp->pages);
 }
 
-/* Remove a buddy block from it's list */
-void __remove_block(buddy_block_t* blk){
-    list_remove(&blk->elem);
+/* Single page free into this CPU's cache, at the hot or the cold end. The cache only
+ * serves unmovable allocations, pages of other pageblocks go straight back */
+static void __pcp_free(uint64_t addr, int cold){
+    pcp_cache_t* pcp = &pcp_caches[this_cpu()];
+
+    if(__block_type(addr) != MIGRATE_UNMOVABLE){
+        __lazy_free(addr, 0);
+        return;
+    }
+    if(cold)
+        list_push_back(&pcp->pages, (list_elem_t*)addr);
+    else
+        list_push_front(&pcp->pages, (list_elem_t*)addr);
+    pcp->count++;
+    if(pcp->count > pcp_high)
+        __pcp_drain(pcp, pcp_batch);
 }
 
-/* Get a memory block from the free blocks */
-void* get_block(size_t num_pages){
-    size_t i, j;
-    list_elem_t* elem;
-    buddy_block_t *blk, *buddy;
+/* Get a memory block of the given mobility from the free blocks */
+void* get_block_mobility(size_t num_pages, int migrate_type){
+    uint64_t addr;
 
     // find list index
-    size_t list_index = pages_to_buddy_index(num_pages);
+    size_t list_index = pages_to_order(num_pages);
+    if (!num_pages || list_index >= NUM_BUDDY_LISTS || migrate_type < 0 || migrate_type >= NUM_MIGRATE_TYPES)
+        return NULL;
 
-    // loop through lists trying to find a suitable block
-    for(i = list_index; i < NUM_BUDDY_LISTS; i++){
+    if (list_index == 0 && migrate_type == MIGRATE_UNMOVABLE){
+        if (!(addr = __pcp_alloc()) && __drain_caches())
+            addr = __pcp_alloc();
+    }
+    else if (!(addr = __lazy_alloc(migrate_type, list_index))
+             && !(addr = __alloc_one(migrate_type, list_index)) && __drain_caches())
+        addr = __alloc_one(migrate_type, list_index); // cached pages may have completed a larger block
+    return (void*)addr;
+}
 
-        // ...if a block is available...
-        if(!list_empty(&buddy_lists[i])){
-            // grab pointer to block
-            elem = list_front(&buddy_lists[i]);
-            blk = list_entry(elem, buddy_block_t, elem);
-
-            // split block until reaching an appropriate size
-            for(j = i-1; j > list_index && j > 0; j--){ // <-- Not sure if condition should be > or >=
-                // try to request a new buddy struct before splitting
-                if(!(buddy = __request_buddy()))
-                    HALT("[!] Failed to get buddy struct from pool!\n");
-
-                // split area
-                buddy->physical_addr = blk->physical_addr + (blk->size * PAGESIZE / 2);
-                buddy->size = blk->size / 2;
-                blk->size = blk->size / 2;
-
-                //add new bud to list
-                __add_block(buddy);
-            }
+/* Get a memory block for kernel structures from the free blocks */
+void* get_block(size_t num_pages){
+    return get_block_mobility(num_pages, MIGRATE_UNMOVABLE);
+}
 
-            // remove block from list and return address
-            __remove_block(blk);
-            return (void*)blk->physical_addr;
-        }
+/* Get a block of num_pages whose contents are zero, single pages come from the zeroed pool */
+void* get_zeroed_block(size_t num_pages){
+    void* addr;
+
+    if (num_pages == 1 && zeroed_count){
+        zeroed_hits++;
+        zeroed_count--;
+        addr = list_pop_front(&zeroed_pages);
+        __builtin_memset(addr, 0, sizeof(list_elem_t)); // the only bytes the pool wrote to
+        return addr;
     }
-    return NULL; // didn't find suitable block
+
+    zeroed_misses++;
+    if ((addr = get_block(num_pages)))
+        clear_pages(addr, 1ULL << pages_to_order(num_pages));
+    return addr;
+}
+
+/**
+ * Zero up to budget free pages into the zeroed pool, with non-temporal stores so the
+ * cache is left alone. Called from the timer tick only when it interrupted user mode
+ * (syscalls run with interrupts off), so it never runs in the middle of the allocator
+ */
+void zero_pool_refill(size_t budget){
+    uint64_t addr;
+
+    while(budget-- && zeroed_count < ZERO_POOL_HIGH && (addr = __alloc_one(MIGRATE_UNMOVABLE, 0))){
+        clear_page_nt((void*)addr);
+        list_push_back(&zeroed_pages, (list_elem_t*)addr);
+        zeroed_count++;
+    }
+}
+
+/* Timer tick work for the page allocator; timer_handler() only calls it when the tick interrupted user mode */
+void allocator_tick(){
+    if(__zone_free_total() < SHRINK_LOW)
+        __run_shrinkers();
+    zero_pool_refill(ZERO_POOL_BATCH);
+}
+
+static void __free_block(void* addr, int cold){
+    uint64_t blk = (uint64_t)addr;
+    int list_index = __get_alloc_order(blk);
+
+    if(list_index < 0)
+        HALT("[!] free_block(): address is not an allocated buddy block!\n");
+    if(list_index == 0)
+        __pcp_free(blk, cold);
+    else
+        __lazy_free(blk, list_index);
+}
+
+/* Size in pages of the allocated block starting at addr, 0 if no block starts there */
+size_t get_block_pages(void* addr){
+    int list_index = __get_alloc_order((uint64_t)addr);
+    return list_index < 0 ? 0 : 1ULL << list_index;
 }
 
 /* free an assigned block */
 void free_block(void* addr){
-    buddy_block_t *blk = NULL, *buddy = NULL;
-    uint64_t pair_addr;
+    __free_block(addr, 0);
+}
+
+/* free a block whose contents are not expected to be touched again soon */
+void free_block_cold(void* addr){
+    __free_block(addr, 1);
+}
+
+/* Get exactly num_pages pages; the rest of the rounded up block goes back on the free lists */
+void* get_block_exact(size_t num_pages){
+    size_t list_index = pages_to_order(num_pages), piece;
+    uint64_t addr, blk;
+    size_t left = num_pages;
+
+    if (!num_pages || list_index >= NUM_BUDDY_LISTS)
+        return NULL;
+    if (!(addr = __alloc_one(MIGRATE_UNMOVABLE, list_index)) && __drain_caches())
+        addr = __alloc_one(MIGRATE_UNMOVABLE, list_index);
+    if (!addr)
+        return NULL;
+
+    // record the kept part as the same aligned pieces free_block_exact() will carve
+    __clear_alloc(addr);
+    for (blk = addr; left; blk += PAGESIZE << piece, left -= 1ULL << piece){
+        piece = __range_piece(blk, left);
+        __set_alloc_order(blk, piece);
+    }
+    __free_range(addr + num_pages * PAGESIZE, (1ULL << list_index) - num_pages);
+    return (void*)addr;
+}
+
+/* Free a block from get_block_exact(), num_pages must match the allocation */
+void free_block_exact(void* addr, size_t num_pages){
+    uint64_t blk = (uint64_t)addr;
+    size_t piece;
+
+    while (num_pages){
+        piece = __range_piece(blk, num_pages);
+        if (__get_alloc_order(blk) != (int)piece)
+            HALT("[!] free_block_exact(): range does not match an exact allocation!\n");
+        __clear_alloc(blk);
+        __free_one(blk, piece);
+        blk += PAGESIZE << piece;
+        num_pages -= 1ULL << piece;
+    }
+}
+
+/* Free block holding the page at addr, with its order in *order. 0 when the page is not free */
+static uint64_t __free_block_at(uint64_t addr, size_t* order){
+    uint64_t blk;
+    size_t i;
+    int found;
+
+    for(i = 0; i < NUM_BUDDY_LISTS; i++){
+        blk = ((addr - offset) & ~((PAGESIZE << i) - 1)) + offset;
+        if((found = __get_free_order(blk)) >= 0 && blk + (PAGESIZE << found) > addr){
+            *order = found;
+            return blk;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Grow or shrink an exact allocation in place. Growing takes the pages right after it,
+ * which must all sit in free buddy blocks; the part of the last block past the new end
+ * goes back. Pages in the per-CPU or lazy caches count as taken. Return 0 on success
+ */
+int resize_block_exact(void* addr, size_t num_pages, size_t new_pages){
+    uint64_t start = (uint64_t)addr, end = start + new_pages * PAGESIZE, blk, next;
+    size_t order, piece, left;
+
+    if(!new_pages || new_pages >= 1ULL << (NUM_BUDDY_LISTS - 1) || __addr_zone(start) != __addr_zone(end - 1))
+        return 1;
+    if(new_pages > num_pages){
+        // check the whole range before taking anything
+        for(next = start + num_pages * PAGESIZE; next < end; next = blk + (PAGESIZE << order)){
+            if(!(blk = __free_block_at(next, &order)))
+                return 1;
+        }
+        for(next = start + num_pages * PAGESIZE; next < end; next = blk + (PAGESIZE << order)){
+            blk = __free_block_at(next, &order);
+            __unlink_free(blk, order);
+            zone_free_pages[__addr_zone(blk)] -= 1ULL << order;
+            if(blk + (PAGESIZE << order) > end)
+                __free_range(end, (blk + (PAGESIZE << order) - end) / PAGESIZE);
+        }
+    }
+
+    // the kept range is recorded as the aligned pieces free_block_exact() will carve
+    for(blk = start, left = num_pages; left; blk += PAGESIZE << piece, left -= 1ULL << piece){
+        piece = __range_piece(blk, left);
+        if(__get_alloc_order(blk) != (int)piece)
+            HALT("[!] resize_block_exact(): range does not match an exact allocation!\n");
+        __clear_alloc(blk);
+    }
+    for(blk = start, left = new_pages; left; blk += PAGESIZE << piece, left -= 1ULL << piece){
+        piece = __range_piece(blk, left);
+        __set_alloc_order(blk, piece);
+    }
+    if(new_pages < num_pages)
+        __free_range(end, num_pages - new_pages);
+    return 0;
+}
+
+/* Allocate an unmovable block of 2^list_index pages from a zone, cut from the head of a free block
+ * of 2^block_index pages or more that ends its first 2^list_index pages at or below max_addr. Like
+ * __alloc_run_zone(), other kinds are only borrowed from, largest block first, and the pageblock
+ * cut from is claimed */
+static uint64_t __alloc_constrained(int zone, size_t block_index, size_t list_index, uint64_t max_addr){
     list_elem_t* e;
-    // naive search for buddy that was mapped to this address
-    if( !(blk = __find_buddy(addr)))
-        HALT("[!] Failed to get buddy struct from pool!\n");
-
-    /* try to find block's buddy */
-    size_t list_index = pages_to_buddy_index(blk->size);
-    pair_addr = ((((uint64_t) addr - offset) ^ (1 << (list_index + PAGESHIFT))) + offset);
-
-    // search list for buddy
-    for(e  = list_begin(&buddy_lists[list_index]); e != list_end(&buddy_lists[list_index]); e = list_next(e)){
-        buddy = list_entry(e, buddy_block_t, elem);
-        if(buddy->physical_addr == pair_addr){
-            break;
+    list_t* list;
+    uint64_t addr;
+    size_t i, k, num;
+    int j, t;
+
+    for(j = -1; j < NUM_MIGRATE_TYPES - 1; j++){
+        t = j < 0 ? MIGRATE_UNMOVABLE : migrate_fallbacks[MIGRATE_UNMOVABLE][j];
+        for(k = block_index; k < NUM_BUDDY_LISTS; k++){
+            i = j < 0 ? k : NUM_BUDDY_LISTS - 1 - (k - block_index);
+            list = &buddy_lists[zone][t][i];
+            for(e = list_begin(list); e != list_end(list); e = list_next(e)){
+                addr = __elem_addr(e);
+                if(addr + (PAGESIZE << list_index) > max_addr)
+                    continue;
+
+                __unlink_free(addr, i);
+                return __take_run(zone, t, MIGRATE_UNMOVABLE, addr, i, list_index, 1, &num);
+            }
         }
     }
-    if(e == list_end(&buddy_lists[list_index])){
-        __add_block(blk);
-    } else {
-        __remove_block(buddy);
-        if(blk->physical_addr > buddy->physical_addr) {
-            buddy->size *= 2;
-            free_block((void*)buddy->physical_addr);
+    return 0;
+}
+
+/**
+ * Get a block for num_pages that ends at or below max_addr and starts on an align
+ * byte boundary. Only zones below max_addr are searched, highest first. Free with free_block()
+ */
+void* get_block_constrained(size_t num_pages, uint64_t max_addr, uint64_t align){
+    size_t list_index = pages_to_order(num_pages), block_index = list_index;
+    uint64_t addr = 0;
+    int zone, retried = 0;
+
+    if (!num_pages || list_index >= NUM_BUDDY_LISTS)
+        return NULL;
+    // buddy blocks are aligned to their size, so a bigger alignment needs a bigger block
+    if (align > PAGESIZE && pages_to_order(align / PAGESIZE) > block_index)
+        block_index = pages_to_order(align / PAGESIZE);
+    if (block_index >= NUM_BUDDY_LISTS)
+        return NULL;
+
+    while (!addr){
+        for (zone = NUM_ZONES - 1; zone >= 0 && !addr; zone--){
+            if (zone_start[zone] < max_addr)
+                addr = __alloc_constrained(zone, block_index, list_index, max_addr);
         }
-        else {
-            blk->size *= 2;
-            free_block((void*)blk->physical_addr);
+        if (!addr && (retried++ || !__drain_caches()))
+            return NULL;
+    }
+    return (void*)addr;
+}
+
+/* Tune the per-CPU page caches */
+void set_pcp_watermarks(size_t low, size_t high, size_t batch){
+    pcp_low = low;
+    pcp_high = high > low ? high : low + 1;
+    pcp_batch = batch ? batch : 1;
+}
+
+/* Let up to high freed pages wait unmerged; 0 merges every block as it is freed */
+void set_lazy_coalescing(size_t high){
+    lazy_high = high;
+    if(lazy_pages > lazy_high)
+        __lazy_flush();
+}
+
+/* Allocate count blocks of 2^order pages into blocks[]. Returns how many were allocated */
+size_t get_blocks_bulk(size_t order, size_t count, void** blocks){
+    size_t k, n = 0, num;
+    uint64_t addr;
+    int retried = 0;
+
+    if(order >= NUM_BUDDY_LISTS)
+        return 0;
+
+    while(n < count){
+        if(!(addr = __alloc_run(MIGRATE_UNMOVABLE, order, count - n, &num))){
+            // cached pages may complete a block, try once more without them
+            if(retried++ || !__drain_caches())
+                break;
+            continue;
         }
+        for(k = 0; k < num; k++)
+            blocks[n++] = (void*)(addr + k * (PAGESIZE << order));
+    }
+    return n;
+}
+
+/* Free count blocks of 2^order pages straight to the buddy lists */
+void free_blocks_bulk(size_t order, size_t count, void** blocks){
+    size_t k;
+    uint64_t blk;
+
+    for(k = 0; k < count; k++){
+        blk = (uint64_t)blocks[k];
+        if(__get_alloc_order(blk) != (int)order)
+            HALT("[!] free_blocks_bulk(): address is not an allocated block of this order!\n");
+        __clear_alloc(blk);
+        __free_one(blk, order);
+    }
+}
+
+void print_pcp_stats(){
+    size_t i, total;
+    pcp_cache_t* pcp;
+
+    printf("[?] Per-CPU page caches (low %d, high %d, batch %d)\n", pcp_low, pcp_high, pcp_batch);
+    for(i = 0; i < MAX_CPUS; i++){
+        pcp = &pcp_caches[i];
+        total = pcp->hits + pcp->misses;
+        if(!total && !pcp->count)
+            continue;
+        printf("\tCPU %d: %d pages, %d hits, %d misses (%d%% hit rate), %d refills, %d drains\n",
+               i, pcp->count, pcp->hits, pcp->misses, total ? pcp->hits * 100 / total : 0,
+               pcp->refills, pcp->drains);
     }
+    printf("[?] Zeroed page pool: %d pages, %d hits, %d misses\n", zeroed_count, zeroed_hits, zeroed_misses);
+    printf("[?] Lazy coalescing (high %d): %d pages unmerged, %d frees deferred, %d merges avoided, %d flushes\n",
+           lazy_high, lazy_pages, lazy_deferred, lazy_reused, lazy_flushes);
+    printf("[?] Shrinkers: %d registered, %d runs, %d pages reclaimed\n", num_shrinkers, shrinker_runs, shrinker_pages);
+}
+
+/* Number of pages currently free in the buddy system, caches and unmerged blocks included */
+size_t buddy_free_pages(){
+    size_t i, free_pages = __zone_free_total() + zeroed_count + lazy_pages;
+
+    for(i = 0; i < MAX_CPUS; i++)
+        free_pages += pcp_caches[i].count;
+    return free_pages;
+}
+
+/**
+ * Fragmentation index of an order, in thousandths: how much a failure to allocate 2^order
+ * pages would be down to free memory being scattered in small blocks (towards 1000) rather
+ * than there being too little of it (towards 0). -1 when a free block of that order exists
+ */
+int buddy_fragmentation_index(size_t order){
+    size_t i, blocks = 0, free_pages = 0;
+
+    if(order >= NUM_BUDDY_LISTS)
+        return 0;
+    for(i = 0; i < NUM_BUDDY_LISTS; i++){
+        if(i >= order && free_block_count[i])
+            return -1;
+        blocks += free_block_count[i];
+        free_pages += free_block_count[i] << i;
+    }
+    if(!blocks)
+        return 0;
+    return 1000 - (1000 + free_pages * 1000 / (1ULL << order)) / blocks;
+}
+
+/* Number of page frames, from address 0, the buddy system can hand out */
+size_t buddy_managed_frames(){
+    return buddy_frames;
+}
+
+/* Bytes of bookkeeping the buddy engine keeps for the frames it manages */
+size_t buddy_metadata_size(){
+    return num_buddy_meta_pages * PAGESIZE;
 }
 
 /**
@@ -187,47 +1038,93 @@ void free_block(void* addr){
  * ####################
  */
 
-/* Unreserve a page. Return 0 on success.*/
-static int __unreserve_page(void* addr){
-    uint64_t idx = (uint64_t)addr >> PAGESHIFT;
-    if(!properties_ptr.info_buffer[idx].reserved)
-        return 1; //already unreserved
-    properties_ptr.info_buffer[idx].reserved = 0;
-    free_memory += PAGESIZE;
-    used_memory -= PAGESIZE;
-    return 0;
+/* Recompute the summary bit of a bitmap word: set when the word has no free frame left */
+static inline void __update_summary(uint64_t w){
+    uint64_t bit = 1ULL << (w % 64);
+
+    if ((properties_ptr.inuse[w] | properties_ptr.reserved[w]) == ~0ULL)
+        properties_ptr.summary[w / 64] |= bit;
+    else
+        properties_ptr.summary[w / 64] &= ~bit;
 }
 
-/* Unreserve pages. Return 0 on success.*/
-static int __unreserve_pages(void* addr, size_t num_pages){
-    for(size_t i = 0 ; i < num_pages; i++){
-        __unreserve_page((void*)((uint64_t)addr + (i * PAGESIZE)));
+/* Set or clear count bits of a bitmap starting at frame first, a word at a time.
+ * Returns the number of frames that changed and are not marked in other, i.e. the
+ * frames whose availability changed */
+static uint64_t __bitmap_update(uint64_t* map, uint64_t* other, uint64_t first, uint64_t count, int set){
+    uint64_t changed = 0, w, n, mask, old;
+
+    while (count){
+        w = first / 64;
+        n = 64 - first % 64;
+        if (n > count) n = count;
+        mask = bit_mask(first % 64, n);
+
+        old = map[w];
+        map[w] = set ? old | mask : old & ~mask;
+        changed += popcount64((old ^ map[w]) & ~other[w]);
+        __update_summary(w);
+
+        first += n;
+        count -= n;
     }
-    return 0;
+    return changed;
 }
 
-/* Reserve a page. Return 0 on success.*/
-static int __reserve_page(void* addr){
-    uint64_t idx = (uint64_t)addr >> PAGESHIFT;
-    if(properties_ptr.info_buffer[idx].reserved)
-        return 1; //already reserved
-    properties_ptr.info_buffer[idx].reserved = 1;
-    free_memory -= PAGESIZE;
-    used_memory += PAGESIZE;
-    return 0;
+/* Number of set bits of a bitmap in a range of frames */
+static uint64_t __bitmap_count(uint64_t* map, uint64_t first, uint64_t count){
+    uint64_t total = 0, n;
+
+    while (count){
+        n = 64 - first % 64;
+        if (n > count) n = count;
+        total += popcount64(map[first / 64] & bit_mask(first % 64, n));
+        first += n;
+        count -= n;
+    }
+    return total;
 }
 
-/* Reserve pages. Return 0 on success.*/
-static int __reserve_pages(void* addr, size_t num_pages){
-    for(size_t i = 0 ; i < num_pages; i++){
-        if(__reserve_page((void*)((uint64_t)addr + (i * PAGESIZE)))){
-            __unreserve_pages(addr, i);
+/**
+ * Mark (set) or unmark num_pages frames from addr in one of the frame bitmaps.
+ * With exclusive, nothing changes if any of the frames is already in the requested
+ * state. The memory counters are adjusted once for the whole range. Return 0 on success.
+ */
+static int __mark_frames(uint64_t* map, void* addr, size_t num_pages, int set, int exclusive){
+    uint64_t first = (uint64_t)addr >> PAGESHIFT;
+    uint64_t* other = map == properties_ptr.inuse ? properties_ptr.reserved : properties_ptr.inuse;
+    uint64_t changed, already;
+
+    if (first >= properties_ptr.size || num_pages > properties_ptr.size - first)
+        return 1;
+    if (exclusive){
+        already = __bitmap_count(map, first, num_pages);
+        if (set ? already : already != num_pages)
             return 1;
-        }
+    }
+
+    changed = __bitmap_update(map, other, first, num_pages, set);
+    if (set){
+        free_memory -= changed * PAGESIZE;
+        used_memory += changed * PAGESIZE;
+    }
+    else{
+        free_memory += changed * PAGESIZE;
+        used_memory -= changed * PAGESIZE;
     }
     return 0;
 }
 
+/* Reserve a range of pages; frames already reserved are left as they are. Return 0 on success.*/
+int reserve_pages(void* addr, size_t num_pages){
+    return __mark_frames(properties_ptr.reserved, addr, num_pages, 1, 0);
+}
+
+/* Make a range of reserved pages allocatable again. Return 0 on success.*/
+int unreserve_pages(void* addr, size_t num_pages){
+    return __mark_frames(properties_ptr.reserved, addr, num_pages, 0, 0);
+}
+
 uint64_t get_memory_map_size(efi_memory_descriptor_t* memory_map, uint64_t memory_map_size, uint64_t memory_map_desc_size){
     static uint64_t total_size = 0;
 
@@ -242,8 +1139,23 @@ uint64_t get_memory_map_size(efi_memory_descriptor_t* memory_map, uint64_t memor
     return total_size;
 }
 
+/* End of the highest segment in the memory map */
+static uint64_t get_memory_map_limit(efi_memory_descriptor_t* memory_map, uint64_t memory_map_size, uint64_t memory_map_desc_size){
+    uint64_t limit = 0;
+
+    for (uint64_t i = 0; i < memory_map_size / memory_map_desc_size; i++){
+        efi_memory_descriptor_t* desc = (efi_memory_descriptor_t*)((uint64_t)memory_map + (i * memory_map_desc_size));
+        if ((uint64_t)desc->physical_addr + desc->num_pages * PAGESIZE > limit)
+            limit = (uint64_t)desc->physical_addr + desc->num_pages * PAGESIZE;
+    }
+    return limit;
+}
+
+/* Reserve the firmware, ACPI and MMIO segments, one bitmap update per run of adjacent entries */
 void reserve_special_segments(efi_memory_descriptor_t* memory_map, uint64_t memory_map_size, uint64_t memory_map_desc_size){
     uint64_t num_map_entries = memory_map_size / memory_map_desc_size;
+    uint64_t run_start = 0, run_pages = 0;
+
     for (int i = 0 ; i < num_map_entries; i++){
         efi_memory_descriptor_t* desc = (efi_memory_descriptor_t*)((uint64_t)memory_map + (i * memory_map_desc_size));
 
@@ -256,9 +1168,18 @@ void reserve_special_segments(efi_memory_descriptor_t* memory_map, uint64_t memo
             desc->type == EFI_MEMORY_MAPPED_IO ||
             desc->type == EFI_MEMORY_MAPPED_IO_PORT_SPACE ||
             desc->type == EFI_PAL_CODE){
-                __reserve_pages(desc->physical_addr, desc->num_pages);
+                if (run_pages && (uint64_t)desc->physical_addr == run_start + run_pages * PAGESIZE){
+                    run_pages += desc->num_pages;
+                    continue;
+                }
+                if (run_pages)
+                    reserve_pages((void*)run_start, run_pages);
+                run_start = (uint64_t)desc->physical_addr;
+                run_pages = desc->num_pages;
             }
     }
+    if (run_pages)
+        reserve_pages((void*)run_start, run_pages);
 }
 
 uint64_t get_largest_segment_size(efi_memory_descriptor_t* memory_map, uint64_t memory_map_size, uint64_t memory_map_desc_size){
@@ -273,104 +1194,179 @@ uint64_t get_largest_segment_size(efi_memory_descriptor_t* memory_map, uint64_t
     return largest;
 }
 
-//give the page properties a space to initialize
-int init_page_properties(efi_memory_descriptor_t* memory_map, uint64_t memory_map_size, uint64_t memory_map_desc_size){
-    //find the largest free segment + its size
-    void* addr = NULL;
-    uint64_t largest = 0;
-    size_t bitmap_size = 0;
+/* Memory used by the firmware and boot loader, reusable once boot services have exited */
+static int __is_boot_memory(uint32_t type){
+    return type == EFI_LOADER_CODE ||
+           type == EFI_LOADER_DATA ||
+           type == EFI_BOOT_SERVICES_CODE ||
+           type == EFI_BOOT_SERVICES_DATA;
+}
+
+/* End of the highest segment the buddy system may manage */
+static uint64_t get_buddy_memory_limit(efi_memory_descriptor_t* memory_map, uint64_t memory_map_size, uint64_t memory_map_desc_size){
+    uint64_t limit = 0;
 
     for (uint64_t i = 0; i < memory_map_size / memory_map_desc_size; i++){
         efi_memory_descriptor_t* desc = (efi_memory_descriptor_t*)((uint64_t)memory_map + (i * memory_map_desc_size));
-        if (desc->type == EFI_CONVENTIONAL_MEMORY && desc->num_pages * PAGESIZE > largest){
-            addr = desc->physical_addr;
-            largest = desc->num_pages * PAGESIZE;
+        if ((desc->type == EFI_CONVENTIONAL_MEMORY || __is_boot_memory(desc->type)) &&
+            (uint64_t)desc->physical_addr + desc->num_pages * PAGESIZE > limit){
+            limit = (uint64_t)desc->physical_addr + desc->num_pages * PAGESIZE;
         }
     }
+    return limit;
+}
+
+/* Give a memory map segment to the buddy, never handing out page 0 */
+static void __free_segment(uint64_t start, uint64_t num_pages){
+    if (!num_pages)
+        return;
+    if (!start){
+        start += PAGESIZE;
+        num_pages--;
+    }
+    __free_range(start, num_pages);
+}
 
-    //caculate the pages to be occupied by the allocator page info
-    uint64_t num_total_mem_pages = get_memory_map_size(memory_map, memory_map_size, memory_map_desc_size) / PAGESIZE;
+/* Mark a range taken during early boot as reserved in the frame bitmaps */
+static void __reserve_range(uint64_t addr, uint64_t num_pages){
+    reserve_pages((void*)addr, num_pages);
+}
+
+//give the page properties a space to initialize
+int init_page_properties(efi_memory_descriptor_t* memory_map, uint64_t memory_map_size, uint64_t memory_map_desc_size){
+    //caculate the pages to be occupied by the allocator bitmaps, indexed by page frame number
+    uint64_t num_total_mem_pages = get_memory_map_limit(memory_map, memory_map_size, memory_map_desc_size) / PAGESIZE;
+    uint64_t num_words = BITMAP_WORDS(num_total_mem_pages);
+    uint64_t num_summary_words = BITMAP_WORDS(num_words);
+    size_t num_bitmap_pages = ((2 * num_words + num_summary_words) * sizeof(uint64_t) + PAGESIZE - 1) / PAGESIZE;
+    void* addr = memblock_alloc(num_bitmap_pages);
+
+    if (!addr)
+        HALT("[!] init_page_properties(): no room for the frame bitmaps!\n");
     properties_ptr.size = num_total_mem_pages;
-    properties_ptr.info_buffer = (page_info_t*)addr;
-    __builtin_memset(properties_ptr.info_buffer, 0, sizeof(page_info_t) * bitmap_size);
+    properties_ptr.inuse = (uint64_t*)addr;
+    properties_ptr.reserved = properties_ptr.inuse + num_words;
+    properties_ptr.summary = properties_ptr.reserved + num_words;
+    clear_pages(addr, num_bitmap_pages);
+
+    // frames past the end of memory are permanently reserved so whole word scans never see them
+    if (num_total_mem_pages % 64)
+        properties_ptr.reserved[num_words - 1] = ~bit_mask(0, num_total_mem_pages % 64);
+    __update_summary(num_words - 1);
+    for(uint64_t w = num_words; w < num_summary_words * 64; w++)
+        properties_ptr.summary[w / 64] |= 1ULL << (w % 64);
 
     //set sizes
     free_memory = get_memory_map_size(memory_map, memory_map_size, memory_map_desc_size);
     used_memory = 0;
 
-    //reserve special segments that should not ever be used to kernel / user
-    __reserve_page(0);
+    // the buddy metadata covers every frame up to the end of the highest conventional segment
+    size_t num_frames = get_buddy_memory_limit(memory_map, memory_map_size, memory_map_desc_size) / PAGESIZE;
+    void* buddy_meta;
+
+    num_buddy_meta_pages = __buddy_meta_pages(num_frames) + __pageblock_meta_pages(num_frames);
+    if (!(buddy_meta = memblock_alloc(num_buddy_meta_pages)))
+        HALT("[!] init_page_properties(): no room for the buddy metadata!\n");
+
+    // descriptors are initialized as they are handed out, the rest starts zeroed
+    clear_pages(buddy_meta, num_buddy_meta_pages);
+    __buddy_meta_init(buddy_meta, num_frames);
+    init_buddy(0, num_frames, (uint8_t*)buddy_meta + PAGESIZE * __buddy_meta_pages(num_frames));
+
+    //reserve special segments that should not ever be used to kernel / user, and everything
+    //taken during early boot (page 0, the metadata above)
     reserve_special_segments(memory_map, memory_map_size, memory_map_desc_size);
+    memblock_for_each_reserved(__reserve_range);
 
-    size_t num_bitmap_pages = properties_ptr.size * 8 / PAGESIZE + 1;
-    num_buddy_pages = largest / PAGESIZE * sizeof(buddy_block_t) / PAGESIZE + 1;
+    // everything memblock did not hand out goes to the buddy in one pass
+    memblock_release(__free_segment);
+    return 0;
+}
 
-    buddy_pool = (buddy_block_t*)(addr + (PAGESIZE * num_bitmap_pages));
-    __reserve_pages(addr, num_bitmap_pages); //reserve bitmap
-    __reserve_pages(buddy_pool, num_buddy_pages); //reserve buddypool
-    for(int i = 0; i < num_buddy_pages; i++){
-        __builtin_memset((void*)buddy_pool + (PAGESIZE / 8 * i), 0, PAGESIZE);
+/* Move the memory map into kernel memory, sort and coalesce it, then give the
+ * boot services and loader regions to the buddy. Returns the pages recovered */
+size_t reclaim_boot_memory(boot_info_t* b_info){
+    uint64_t num_map_entries = b_info->memory_map_size / b_info->memory_map_desc_size;
+    size_t map_pages = (num_map_entries * sizeof(efi_memory_descriptor_t) + PAGESIZE - 1) / PAGESIZE;
+    size_t free_pages_before;
+    efi_memory_descriptor_t* map;
+    uint64_t i, j, n = 0;
+
+    if (!(map = get_block(map_pages)))
+        HALT("[!] reclaim_boot_memory(): Failed to allocate a copy of the memory map!\n");
+
+    // copy out of the loader's pool, insertion sorted by physical address
+    for (i = 0; i < num_map_entries; i++){
+        efi_memory_descriptor_t* desc = (efi_memory_descriptor_t*)((uint64_t)b_info->memory_map + (i * b_info->memory_map_desc_size));
+        for (j = n; j > 0 && map[j - 1].physical_addr > desc->physical_addr; j--)
+            map[j] = map[j - 1];
+        map[j] = *desc;
+        n++;
     }
 
-    //init buddy
-    init_buddy((void*)((uint64_t)buddy_pool + PAGESIZE * num_buddy_pages), (largest / PAGESIZE) - num_bitmap_pages - num_buddy_pages);
-    return 0;
+    // coalesce contiguous entries of the same type
+    for (i = 0, j = 0; i < n; i++){
+        if (j && map[j - 1].type == map[i].type && map[j - 1].attributes == map[i].attributes &&
+            map[j - 1].physical_addr + map[j - 1].num_pages * PAGESIZE == map[i].physical_addr){
+            map[j - 1].num_pages += map[i].num_pages;
+            continue;
+        }
+        map[j++] = map[i];
+    }
+    n = j;
+
+    // from here on the kernel only uses its own copy of the map
+    free_pages_before = __zone_free_total();
+    b_info->memory_map = map;
+    b_info->memory_map_size = n * sizeof(efi_memory_descriptor_t);
+    b_info->memory_map_desc_size = sizeof(efi_memory_descriptor_t);
+
+    for (i = 0; i < n; i++){
+        if (__is_boot_memory(map[i].type))
+            __free_segment((uint64_t)map[i].physical_addr, map[i].num_pages);
+    }
+    return __zone_free_total() - free_pages_before;
 }
 
 /* Allocate a page. Return 0 on success.*/
 int alloc_page(void* addr){
-    uint64_t idx = (uint64_t)addr >> PAGESHIFT;
-    if(properties_ptr.info_buffer[idx].inuse)
-        return 1; //already in use
-    properties_ptr.info_buffer[idx].inuse = 1;
-    free_memory -= PAGESIZE;
-    used_memory += PAGESIZE;
-    return 0;
+    return __mark_frames(properties_ptr.inuse, addr, 1, 1, 1);
 }
 
-/* Allocate a page. Return 0 on success.*/
+/* Allocate a range of pages, failing if any of them is already allocated. Return 0 on success.*/
 int alloc_pages(void* addr, size_t num_pages){
-    for(size_t i = 0 ; i < num_pages; i++){
-        if(alloc_page((void*)((uint64_t)addr + (i * PAGESIZE)))){
-            free_pages(addr, i);
-            return 1;
-        }
-    }
-    return 0;
+    return __mark_frames(properties_ptr.inuse, addr, num_pages, 1, 1);
 }
 
 /* Free a page. Return 0 on success.*/
 int free_page(void* addr){
-    uint64_t idx = (uint64_t)addr >> PAGESHIFT;
-    if(!properties_ptr.info_buffer[idx].inuse)
-        return 1; //already freed
-    properties_ptr.info_buffer[idx].inuse = 0;
-    free_memory += PAGESIZE;
-    used_memory -= PAGESIZE;
-    return 0;
+    return __mark_frames(properties_ptr.inuse, addr, 1, 0, 1);
 }
-
+/* Free a range of pages. Return 0 on success.*/
 int free_pages(void* addr, size_t num_pages){
-    for(size_t i = 0 ; i < num_pages; i++){
-        //NOTE: (nick) worry about double free? probs not
-        free_page((void*)((uint64_t)addr + (i * PAGESIZE)));
-    }
+    //NOTE: (nick) worry about double free? probs not
+    __mark_frames(properties_ptr.inuse, addr, num_pages, 0, 0);
     return 0;
 }
 
 /* Find the first free page and then allocate it*/
 void* request_page(){
-    for (uint64_t i = 0; i < properties_ptr.size; i++){
-        if (properties_ptr.info_buffer[i].inuse || properties_ptr.info_buffer[i].reserved) continue;
-        alloc_page((void *)(i * PAGESIZE));
-        return (void *)(i * PAGESIZE);
+    uint64_t s, w, idx;
+
+    // the summary points at the first word with a free frame, that word at the frame
+    for (s = 0; s < BITMAP_WORDS(BITMAP_WORDS(properties_ptr.size)); s++){
+        if (properties_ptr.summary[s] == ~0ULL) continue;
+        w = s * 64 + ctz64(~properties_ptr.summary[s]);
+        idx = w * 64 + ctz64(~(properties_ptr.inuse[w] | properties_ptr.reserved[w]));
+        alloc_page((void *)(idx * PAGESIZE));
+        return (void *)(idx * PAGESIZE);
     }
     return NULL;
 }
 
 void print_available_memory(){
-    printf("Currently Used: %d\n", used_memory);
-    printf("Currently Free: %d\n", free_memory);
+    printf("Currently Used: %llu\n", used_memory);
+    printf("Currently Free: %llu\n", free_memory);
 }
 
 void print_allocator(){
@@ -383,10 +1379,10 @@ void print_allocator(){
     for (uint64_t i = 0; i < properties_ptr.size; i++){
         old_state = current_state;
 
-        if (properties_ptr.info_buffer[i].inuse){ // inuse
+        if (test_bit(properties_ptr.inuse, i)){ // inuse
             current_state = 1;
         }
-        else if (properties_ptr.info_buffer[i].reserved){ //reserved
+        else if (test_bit(properties_ptr.reserved, i)){ //reserved
             current_state = 2;
         }
         else{ // free
@@ -413,19 +1409,28 @@ void print_allocator(){
 
 void debug_buddy_lists(){
     size_t i;
+    int zone, t;
     list_elem_t* e;
-    buddy_block_t *blk;
+    list_t* list;
 
     printf("[?] Debugging buddy list...\n");
-    for(i = 0; i < NUM_BUDDY_LISTS; i++){
-        if(!list_empty(&buddy_lists[i])){
-            printf("\tBuddy List #%d (size = %d)\n", i, 1 << i);
-            for(e = list_begin(&buddy_lists[i]); e != list_end(&buddy_lists[i]); e = list_next(e)){
-                blk = list_entry(e, buddy_block_t, elem);
-                printf("   buddy: %p -> size: 0x%llx, paddr: %p\n", blk, blk->size * PAGESIZE, (void*)blk->physical_addr);
+    for(zone = 0; zone < NUM_ZONES; zone++){
+        printf("\tZone %s: %d pages free\n", zone_names[zone], zone_free_pages[zone]);
+        for(t = 0; t < NUM_MIGRATE_TYPES; t++){
+            for(i = 0; i < NUM_BUDDY_LISTS; i++){
+                list = &buddy_lists[zone][t][i];
+                if(!list_empty(list)){
+                    printf("\t%s Buddy List #%d (size = %d)\n", migrate_names[t], i, 1 << i);
+                    for(e = list_begin(list); e != list_end(list); e = list_next(e)){
+                        printf("   buddy: %p -> size: 0x%llx, paddr: %p\n", e, PAGESIZE << i, (void*)__elem_addr(e));
+                    }
+                }
             }
         }
     }
-    printf("[?] End debugging buddy list\n");
+    printf("\t%d fallback allocations, %d pageblocks changed mobility\n", mobility_fallbacks, pageblocks_claimed);
+    printf("\tFragmentation index per order (/1000, -1 = block available):\n\t");
+    for(i = 0; i < NUM_BUDDY_LISTS && (1ULL << i) <= buddy_frames; i++)
+        printf(" %d:%d", i, buddy_fragmentation_index(i));
+    printf("\n[?] End debugging buddy list\n");
 }
-
@@ -7,6 +7,10 @@
 #include <msr.h>
 #include <apic.h>
 #include <printf.h>
+#include <allocator.h>
+
+/* timer_apic's SAVE_REGS pushes 9 registers, the interrupt frame then holds rip and cs */
+#define TIMER_FRAME_CS 10
 
 static void *lapic_base = NULL;
 static uint64_t time = 0;
@@ -145,8 +149,11 @@ x86_lapic_enable(void)
     time_ptr = &time;
 }
 
-/* timer handler */
-void timer_handler(){
+/* timer handler, regs points at what timer_apic saved: SAVE_REGS then the interrupt frame */
+void timer_handler(uint64_t* regs){
     time++; // increment timer
+    // only user mode can be interrupted outside the allocator, kernel_start() runs with interrupts on
+    if((regs[TIMER_FRAME_CS] & 3) == 3)
+        allocator_tick(); // background page zeroing
     x86_lapic_write(X86_LAPIC_EOI, 0x00U); //ack
 }
@@ -11,6 +11,7 @@
 #include<msr.h>
 #include<page_table.h>
 #include<allocator.h>
+#include<memblock.h>
 #include<slob.h>
 #include<halt.h>
 
@@ -25,6 +26,7 @@ void *gp_hdl_ptr; /*general protection handler; set in kernel_entry.S*/
 static gate_descriptor_t idt[256] __attribute__((aligned(16))); // IDT table
 page_pml_t* user_pml;
 extern uint64_t* time_ptr;
+static boot_info_t boot_info; /*kernel copy, the loader's lives in boot services memory*/
 
 /* Fills out a vector of the IDT table */
 static void x86_fillgate(int num, void *fn, int ist){
@@ -110,9 +112,9 @@ void show_buddy_system(void){
     void* a = get_block(256);
     debug_buddy_lists();
 
-    printf("\nRequesting 3 block of 34 pages\n");
+    printf("\nRequesting 3 exact blocks of 34 pages\n");
     for(uint64_t i = 0 ; i < 3; i++){
-        get_block(34);
+        get_block_exact(34);
     }
     debug_buddy_lists();
 
@@ -141,10 +143,52 @@ void show_slob_alloc(void){
     slob_list_counts();
 }
 
+#define BENCH_OBJECTS 448
+#define BENCH_PASSES 1000
+
+static void* bench_objs[BENCH_OBJECTS];
+
+/* Cycles per 100 writes to the first word of every object, over fresh slabs carved with or without coloring */
+uint64_t walk_slab_objects(kmem_cache_t* cache, int coloring){
+    uint64_t start, cycles;
+
+    slob_set_coloring(coloring);
+    for(uint64_t i = 0; i < BENCH_OBJECTS; i++){
+        if(!(bench_objs[i] = kmem_cache_alloc(cache)))
+            HALT("[!] Slab coloring benchmark ran out of memory!\n");
+    }
+
+    start = rdtsc();
+    for(uint64_t pass = 0; pass < BENCH_PASSES; pass++){
+        for(uint64_t i = 0; i < BENCH_OBJECTS; i++)
+            (*(volatile uint64_t*)bench_objs[i])++;
+    }
+    cycles = rdtsc() - start;
+
+    for(uint64_t i = 0; i < BENCH_OBJECTS; i++)
+        kmem_cache_free(cache, bench_objs[i]);
+    slob_shrink(); // the next walk gets slabs of its own
+    return cycles * 100 / (BENCH_PASSES * BENCH_OBJECTS);
+}
+
+void bench_slab_coloring(void){
+    // 1 KiB apart, uncolored objects only ever touch 4 of the 64 L1 sets
+    kmem_cache_t* cache = kmem_cache_create("bench-1000", 1000, SLAB_CACHE_LINE, NULL);
+
+    if(!cache)
+        HALT("[!] Failed to create the benchmark cache!\n");
+    printf("[|] Slab coloring benchmark: %d objects of %d b, %d colors\n", BENCH_OBJECTS, cache->size, cache->colors);
+    printf("\tuncolored: %d cycles per 100 accesses\n", walk_slab_objects(cache, 0));
+    printf("\tcolored: %d cycles per 100 accesses\n", walk_slab_objects(cache, 1));
+}
+
 void kernel_start(uint64_t* kernel_ptr, boot_info_t* b_info) {
     int rc;
+    boot_info = *b_info;
+    b_info = &boot_info;
     syscall_init(); //initialize system calls
     fb_init(b_info->framebuffer, 1600, 900);
+    memblock_init(b_info->memory_map, b_info->memory_map_size, b_info->memory_map_desc_size);
     init_page_properties(b_info->memory_map, b_info->memory_map_size, b_info->memory_map_desc_size);
 
     //reserve space used by kernel code and framebuffer
@@ -153,12 +197,17 @@ void kernel_start(uint64_t* kernel_ptr, boot_info_t* b_info) {
     printf("[|] Alloc_pages returned %d\n", rc);
     alloc_page( (void*)((uint64_t)(b_info->framebuffer) & ~PAGESHIFT));
     printf("[|] Largest segment size: %d\n", get_largest_segment_size(b_info->memory_map, b_info->memory_map_size, b_info->memory_map_desc_size) / 1024);
+    printf("[|] Buddy metadata size: %d kb\n", buddy_metadata_size() / 1024);
+    printf("[|] Buddy free memory: %d kb\n", buddy_free_pages() * PAGESIZE / 1024);
 
     /* Create kernel page table */
-    page_pml_t* kernel_pml = (page_pml_t*) get_block(1);
-    clear_page(kernel_pml);
+    page_pml_t* kernel_pml = (page_pml_t*) get_zeroed_block(1);
     uint64_t size = get_memory_map_size(b_info->memory_map, b_info->memory_map_size, b_info->memory_map_desc_size);
 
+    // the buddy hands out pages up to the end of the highest segment, past the summed size when the map has holes
+    if(size < buddy_managed_frames() * PAGESIZE)
+        size = buddy_managed_frames() * PAGESIZE;
+
     printf("Kernel pml: %p\n", kernel_pml);
     for(uint64_t i = 0; i < size; i += PAGESIZE){
         if((rc = map_memory(kernel_pml, (void*)i, (void*)i, 0))){
@@ -185,15 +234,22 @@ void kernel_start(uint64_t* kernel_ptr, boot_info_t* b_info) {
         }
     }
 
+    // the firmware's page tables live in boot services memory, stop using them before it is reclaimed
+    write_cr3((uint64_t)kernel_pml);
+    printf("[|] Reclaimed %d pages of boot memory\n", reclaim_boot_memory(b_info));
+
+    print_pcp_stats();
+    zero_pool_refill((size_t)-1); // fill the zeroed pool before the timer starts topping it up
+
     x86_lapic_enable(); //initialize local apic controller
     setup_interrupts((tss_segment_t*) b_info->tss_buffer);
 
-    // slob_init(50);
+    // slob_init();
     // show_slob_alloc();
+    // bench_slab_coloring();
 
     //setup user stuff
-    user_pml = (page_pml_t*) get_block(1);
-    clear_page(user_pml);
+    user_pml = (page_pml_t*) get_zeroed_block(1);
     user_pml[0].page_address = kernel_pml[0].page_address;
     user_pml[0].writable = 1;
     user_pml[0].present = 1;
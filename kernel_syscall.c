@@ -14,7 +14,8 @@ extern uint64_t* time_ptr;
 
 typedef struct boundary_block{
     size_t free:1;
-    size_t size:63;
+    size_t prev_alloc:1;
+    size_t size:62;
 }boundary_block_t;
 
 #define TAGSIZE sizeof(boundary_block_t)
@@ -33,9 +34,9 @@ void debug_heap(){
         printf("Heap empty\n");
         return;
     }
-    while(!tmp->size){ //print and hop until last fence
+    while(tmp->size){ //print and hop until last fence
         printf("%p, size: %d, free: %d\n", tmp, tmp->size, tmp->free);
-        ptr += (tmp->size + TAGSIZE * 2);
+        ptr += (tmp->size + TAGSIZE);
         tmp = (boundary_block_t*)ptr;
     }
     printf("[?] Done debugging user heap...\n");
@@ -43,7 +44,7 @@ void debug_heap(){
 
 long assign_heap(long size){
     uint64_t base_vaddr = 0x18000000000;
-    if(!(user_heap_ptr = get_block(size)) ){
+    if(!(user_heap_ptr = get_block_mobility(size, MIGRATE_MOVABLE)) ){
         printf("[!] assign_heap(): Failed to get block of %d pages\n", size);
         return 1;
     }
@@ -57,7 +58,7 @@ long assign_heap(long size){
 
 long do_syscall_entry(long n, long a1, long a2, long a3, long a4, long a5)
 {
-    if( n < 0 || n > 4)
+    if( n < 0 || n > 5)
         return -1; // unknown syscall
     else if (n == 0)
         printf((char*)a1);
@@ -69,6 +70,8 @@ long do_syscall_entry(long n, long a1, long a2, long a3, long a4, long a5)
         printf((char*)a1, a2);
     else if (n==4)
         printf("%s: %p\n", (char*)a1, *time_ptr); //print time
+    else if (n==5) //fragmentation index of order a1
+        return buddy_fragmentation_index(a1);
     return 0; /* Success */
 }
 
@@ -3,27 +3,48 @@
 #define PAGESIZE 4096ULL
 #define PAGESHIFT 12ULL
 
+/* Buddy engine, chosen at build time (-DBUDDY_BITMAP=1):
+ *  0 - descriptor pool with a page-frame indexed descriptor table
+ *  1 - per-order pair bitmaps, free-list links kept inside the free pages */
+#ifndef BUDDY_BITMAP
+#define BUDDY_BITMAP 0
+#endif
+
 #include <list.h>
 
-/* page frame attributes */
-typedef struct page_info {
-    uint8_t inuse : 1;
-    uint8_t reserved : 1;
-    uint8_t __padding : 6;  // don't access this
-} page_info_t;
+/* Physical memory zones */
+#define ZONE_DMA32 0 //below 4 GiB
+#define ZONE_NORMAL 1 //everything else
+#define NUM_ZONES 2
+#define ZONE_DMA32_LIMIT 0x100000000ULL
+
+/* Page mobility; allocations of one kind are grouped into the same pageblocks so
+ * pinned pages do not end up scattered over memory that could otherwise merge */
+#define MIGRATE_UNMOVABLE 0 //pinned kernel structures
+#define MIGRATE_RECLAIMABLE 1 //caches that can be given back under pressure
+#define MIGRATE_MOVABLE 2 //user memory
+#define NUM_MIGRATE_TYPES 3
+#define PAGEBLOCK_ORDER 9 //pages are grouped in 2 MiB pageblocks
 
-/* page table information block */
+/* Gives cached memory back to the buddy system under pressure; returns the pages freed */
+typedef size_t (*shrinker_fn_t)();
+#define MAX_SHRINKERS 4
+
+/* page frame attributes, one bit per page frame in each bitmap */
 typedef struct page_properties {
-    size_t size;
-    page_info_t* info_buffer;
+    size_t size; //number of page frames tracked
+    uint64_t* inuse; //frames handed out
+    uint64_t* reserved; //frames that must never be handed out
+    uint64_t* summary; //one bit per inuse/reserved word, set when the word has no free frame
 } page_properties_t;
 
 /* Data for each buddy block, stored in double linked lists*/
 typedef struct buddy_block {
     //start + size
     uint64_t physical_addr; //physical addr of the start of this block
-    size_t size; //size of this buddy block in bytes; 0 when not in use
-    list_elem_t elem;
+    size_t size; //size of this buddy block in pages; 0 when the descriptor is unused
+    uint64_t free; //1 while the block sits on a buddy list
+    list_elem_t elem; //list link; next links the descriptor free stack when unused
 } buddy_block_t;
 
 /* Walk the memory map and sum the segments to get the total memory map size*/
@@ -34,11 +55,21 @@ uint64_t get_memory_map_size(efi_memory_descriptor_t* memory_map,
 /*Find the largest segment of free physical memory */          
 uint64_t get_largest_segment_size(efi_memory_descriptor_t* memory_map, uint64_t memory_map_size, uint64_t memory_map_desc_size);
 
-/*Init for both the naive page frame allocator and the buddy list*/
+/*Init for both the naive page frame allocator and the buddy list. Takes its metadata from
+  memblock (memblock_init() must have run) and then releases all remaining memory to the buddy*/
 int init_page_properties(efi_memory_descriptor_t* memory_map,
                          uint64_t memory_map_size,
                          uint64_t memory_map_desc_size);
 
+/*Give boot services and loader memory to the buddy system; returns the pages recovered.
+  Moves b_info's memory map into kernel memory, so b_info itself must not live in boot memory.
+  CR3 must already point at kernel-built page tables, the firmware's are in that memory*/
+size_t reclaim_boot_memory(boot_info_t* b_info);
+
+/*Reserve or unreserve a range of page frames so the naive allocator never hands them out*/
+int reserve_pages(void* addr, size_t num_pages);
+int unreserve_pages(void* addr, size_t num_pages);
+
 /*Allocate pages using the naive page frame allocator*/
 int alloc_page(void* addr);
 int alloc_pages(void* addr, size_t num_pages);
@@ -53,13 +84,78 @@ void* request_page();
 /*Set the contents of a page to 0*/
 void clear_page(void* addr);
 
+/*Set the contents of a page to 0 without pulling it into the cache*/
+void clear_page_nt(void* addr);
+
+/*Set the contents of num_pages contiguous pages to 0*/
+void clear_pages(void* addr, size_t num_pages);
+
 /*ask the buddy system for num_pages*/
 void* get_block(size_t num_pages);
 
+/*ask the buddy system for num_pages of the given mobility (MIGRATE_*)*/
+void* get_block_mobility(size_t num_pages, int migrate_type);
+
+/*ask the buddy system for num_pages of zeroed memory, preferring the pre-zeroed pool*/
+void* get_zeroed_block(size_t num_pages);
+
+/*zero up to budget free pages into the pre-zeroed pool*/
+void zero_pool_refill(size_t budget);
+
+/*call fn whenever an allocation fails or free memory runs low; return 0 on success*/
+int register_shrinker(shrinker_fn_t fn);
+
+/*background allocator work, run from the timer interrupt when it interrupted user mode*/
+void allocator_tick();
+
 /*free for the buddy system at the given address*/
 void free_block(void* addr);
 
+/*size in pages of the buddy block allocated at addr, 0 if none starts there*/
+size_t get_block_pages(void* addr);
+
+/*ask the buddy system for exactly num_pages, returning the unused tail of the block to the free lists*/
+void* get_block_exact(size_t num_pages);
+
+/*free an exact allocation; num_pages must match the call to get_block_exact()*/
+void free_block_exact(void* addr, size_t num_pages);
+
+/*grow or shrink an exact allocation to new_pages without moving it; return 0 on success,
+  nonzero if the pages after it are not free*/
+int resize_block_exact(void* addr, size_t num_pages, size_t new_pages);
+
+/*ask the buddy system for num_pages ending at or below max_addr, aligned to align bytes*/
+void* get_block_constrained(size_t num_pages, uint64_t max_addr, uint64_t align);
+
+/*allocate count blocks of 2^order pages into blocks[]; returns the number allocated*/
+size_t get_blocks_bulk(size_t order, size_t count, void** blocks);
+
+/*free count blocks of 2^order pages*/
+void free_blocks_bulk(size_t order, size_t count, void** blocks);
+
+/*free a block that is cache cold; single pages go to the cold end of the per-CPU cache*/
+void free_block_cold(void* addr);
+
+/*tune the per-CPU single page caches: refill at <= low pages, drain above high, batch pages at a time*/
+void set_pcp_watermarks(size_t low, size_t high, size_t batch);
+
+/*let up to high freed pages wait unmerged for reuse at the same size; 0 merges on every free*/
+void set_lazy_coalescing(size_t high);
+
+/*number of pages currently free in the buddy system*/
+size_t buddy_free_pages();
+
+/*fragmentation index of an order in thousandths, -1 while a free block of that order exists*/
+int buddy_fragmentation_index(size_t order);
+
+/*number of page frames, counted from address 0, that buddy blocks can come from*/
+size_t buddy_managed_frames();
+
+/*bytes of metadata used by the buddy engine*/
+size_t buddy_metadata_size();
+
 /*Debugging print outs for naive and buddy allocator*/
 void print_available_memory();
 void print_allocator();
-void debug_buddy_lists();
\ No newline at end of file
+void debug_buddy_lists();
+void print_pcp_stats();
\ No newline at end of file
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <types.h>
+
+/* Number of set bits. Plain C so the kernel needs neither popcnt nor libgcc */
+static inline uint64_t popcount64(uint64_t x){
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (x * 0x0101010101010101ULL) >> 56;
+}
+
+/* Index of the lowest set bit; x must not be 0 */
+static inline uint64_t ctz64(uint64_t x){
+    return __builtin_ctzll(x);
+}
+
+/* count bits starting at bit first; count in 1..64 and first + count <= 64 */
+static inline uint64_t bit_mask(uint64_t first, uint64_t count){
+    return (count == 64 ? ~0ULL : ((1ULL << count) - 1)) << first;
+}
+
+static inline int test_bit(uint64_t* map, uint64_t bit){
+    return (map[bit / 64] >> (bit % 64)) & 1;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <types.h>
+
+#define MEMBLOCK_MAX_REGIONS 128
+
+/* A physical range, page aligned */
+typedef struct memblock_region {
+    uint64_t base;
+    uint64_t size; //in bytes
+} memblock_region_t;
+
+/* Sorted, non-overlapping and non-adjacent regions */
+typedef struct memblock_type {
+    size_t count;
+    memblock_region_t regions[MEMBLOCK_MAX_REGIONS];
+} memblock_type_t;
+
+/*Build the early allocator from the conventional segments of the EFI memory map*/
+void memblock_init(efi_memory_descriptor_t* memory_map,
+                   uint64_t memory_map_size,
+                   uint64_t memory_map_desc_size);
+
+/*Add a range of usable memory. Return 0 on success*/
+int memblock_add(uint64_t base, uint64_t size);
+
+/*Keep a range from being allocated or handed to the buddy system. Return 0 on success*/
+int memblock_reserve(uint64_t base, uint64_t size);
+
+/*Bump allocate num_pages of usable memory; NULL when nothing fits or memblock was released*/
+void* memblock_alloc(size_t num_pages);
+
+/*Call fn on every reserved range*/
+void memblock_for_each_reserved(void (*fn)(uint64_t addr, uint64_t num_pages));
+
+/*Hand every free range to release and retire the early allocator; returns the pages released*/
+size_t memblock_release(void (*release)(uint64_t addr, uint64_t num_pages));
+
+/*Debugging print out of the memory and reserved regions*/
+void memblock_dump();
@@ -28,6 +28,18 @@ static inline uint64_t rdmsr(uint32_t reg)
 	return ((uint64_t) val_high << 32) | val_low;
 }
 
+static inline uint64_t rdtsc(void)
+{
+	uint32_t val_low, val_high;
+
+	__asm__ __volatile__ ("rdtsc"
+		: "=a" (val_low),
+		  "=d" (val_high)
+	);
+
+	return ((uint64_t) val_high << 32) | val_low;
+}
+
 static inline void wrmsr(uint32_t reg, uint64_t val)
 {
 	__asm__ __volatile__ ("wrmsr"
@@ -5,15 +5,88 @@
 #include <list.h>
 #include <halt.h>
 #include <types.h>
+#include <smp.h>
+#include <spinlock.h>
 
+/* Largest request served by the size classes; bigger ones get whole buddy blocks */
+#define KMALLOC_MAX_CACHE_SIZE 2048
 
-typedef enum slob_type {SMALL, MEDIUM, LARGE} slob_type_t;
+/* Header at the start of the exact buddy allocation behind a kmalloc() too big for the size classes */
+typedef struct kmalloc_large {
+  size_t pages; //pages of the exact allocation
+  size_t size; //bytes asked for, the object follows the header
+} kmalloc_large_t;
 
-typedef struct slob_blk {
-  list_elem_t elem;
-  slob_type_t size;
-  char padding[48];
-} slob_blk_t;
+/* Alignment that keeps objects of a cache from sharing cache lines */
+#define SLAB_CACHE_LINE 64
+
+/* A slab: one buddy block cut into equal objects, with this header at its start.
+ * Every page of the slab maps back to it through the slab page-frame table */
+typedef struct kmem_slab {
+  list_elem_t elem; //link in the cache's full, partial or empty list
+  struct kmem_cache* cache; //cache the slab belongs to
+  void* free; //first free object; free objects link through their first word
+  void* base; //first object
+  size_t inuse; //objects handed out
+  unsigned int owner; //CPU that carved the slab, other CPUs free through remote_free
+  void* volatile remote_free; //objects freed by other CPUs, not yet collected by the owner
+  struct kmem_slab* volatile remote_next; //link in the owner's list of slabs with remote frees
+} kmem_slab_t;
+
+/* Objects per magazine, chosen so a magazine fills a 128 byte object */
+#define MAGAZINE_ROUNDS 13
+
+/* A magazine: a stack of free objects a CPU can take from or fill without locking */
+typedef struct kmem_magazine {
+  list_elem_t elem; //link in the depot
+  size_t rounds; //objects held
+  void* objs[MAGAZINE_ROUNDS];
+} kmem_magazine_t;
+
+/* A CPU's magazines for one cache; either may be NULL */
+typedef struct kmem_cpu_cache {
+  kmem_magazine_t* loaded;
+  kmem_magazine_t* previous;
+  kmem_slab_t* volatile remote_slabs; //slabs of this CPU other CPUs freed objects to
+  size_t hits; //served from the magazines
+  size_t misses; //had to go to the slab layer
+  size_t remote_frees; //objects this CPU freed to other CPUs' slabs
+  size_t remote_collected; //objects other CPUs freed to this CPU's slabs
+} kmem_cpu_cache_t;
+
+/* Called on every object when its slab is carved, never again while the slab lives */
+typedef void (*kmem_ctor_t)(void* obj);
+
+/* An object cache: per-CPU magazines in front of a depot, in front of the slabs */
+typedef struct kmem_cache {
+  list_elem_t elem; //link in the list of all caches
+  const char* name;
+  size_t size; //object size
+  size_t align; //alignment of every object, a power of two
+  size_t stride; //distance between objects, size rounded up to align
+  size_t offset; //where a free object keeps its free list link
+  kmem_ctor_t ctor; //NULL if objects need no constructed state
+  size_t num; //objects per slab
+  size_t slab_pages; //pages per slab, a power of two
+  size_t colors; //distinct offsets the first object of a slab can start at
+  size_t color_next; //offset index for the next slab
+  size_t color_off; //distance between those offsets, at least a cache line
+  kmem_cpu_cache_t cpu[MAX_CPUS];
+  spinlock_t depot_lock;
+  list_t depot_full;
+  list_t depot_empty;
+  size_t depot_exchanges; //magazines swapped with the depot
+  spinlock_t lock; //protects the slab lists
+  list_t slabs_full;
+  list_t slabs_partial;
+  list_t slabs_empty;
+  size_t num_slabs;
+  // statistics
+  size_t allocs; //objects handed out since boot
+  size_t frees;
+  size_t requested; //bytes asked for by those allocations
+  size_t reaped; //empty slabs given back to the buddy system
+} kmem_cache_t;
 
 //allocates memory through slab allocator.
 void *kmalloc(size_t size);
@@ -21,7 +94,8 @@ void *kmalloc(size_t size);
 //allocates memory (and zeroes it out like calloc() in libc) through the slab allocator.
 void *kzalloc(size_t size);
 
-//resize existing allocation.
+//resize existing allocation, in place when the size class or the pages after it allow,
+//otherwise moving the contents to a new one.
 void * krealloc(void *addr, size_t size);
 
 //frees memory previously allocated.
@@ -30,14 +104,29 @@ void kfree(void *addr);
 //frees memory previously allocated and zeros out space.
 void kzfree(void *addr);
 
-//print all elements of all slob lists
+//create a cache of size byte objects aligned to align (0 for word alignment); ctor, if set,
+//runs once per object when its slab is carved and freed objects must be handed back constructed.
+//Returns NULL when the object does not fit a slab
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, kmem_ctor_t ctor);
+
+//allocates a constructed object from the cache.
+void* kmem_cache_alloc(kmem_cache_t* cache);
+
+//gives an object back to the cache it came from, in its constructed state.
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+
+//turn slab coloring on or off for slabs carved from now on; on by default
+void slob_set_coloring(int enable);
+
+//print all slabs of all caches
 void debug_slob_lists();
 
-//initialize slob lists
-void slob_init(size_t num_pages);
+//initialize the size classes; slabs grow on demand and the shrinker returns empty ones
+void slob_init();
 
-//alloc slob. Should be removed from .h once tested
-void *__slob_alloc(size_t size);
+//print usage and internal fragmentation of every cache
+void slob_list_counts();
 
-//print number element from all slob lists
-void slob_list_counts();
\ No newline at end of file
+//give every empty slab back to the buddy system; returns the pages released.
+//registered as a shrinker, so it also runs when the buddy system is short of memory
+size_t slob_shrink();
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <types.h>
+
+/* Upper bound on the CPUs per-CPU data is sized for */
+#define MAX_CPUS 8
+
+/* Index of the CPU we are running on. Only the bootstrap processor runs kernel code for now */
+static inline unsigned int this_cpu(void){
+    return 0;
+}
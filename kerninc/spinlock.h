@@ -0,0 +1,26 @@
+#pragma once
+
+/* Test-and-test-and-set spinlock */
+typedef struct spinlock {
+    volatile int locked;
+} spinlock_t;
+
+static inline void spin_lock_init(spinlock_t* lock){
+    lock->locked = 0;
+}
+
+static inline void spin_lock(spinlock_t* lock){
+    while(__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)){
+        while(lock->locked)
+            asm volatile("pause");
+    }
+}
+
+/* Take the lock only if it is free. Return 1 when taken */
+static inline int spin_trylock(spinlock_t* lock){
+    return !lock->locked && !__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void spin_unlock(spinlock_t* lock){
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
@@ -6,19 +6,20 @@ lld-link /dll /nodefaultlib /safeseh:no /machine:AMD64 /entry:efi_main boot.o /o
 ../fwimage/fwimage app boot.dll boot.efi
 
 # Compile the kernel
-gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -pie -fno-zero-initialized-in-bss -c kernel_entry.S
-gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -pie -fno-zero-initialized-in-bss -c apic.c
-gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -pie -fno-zero-initialized-in-bss -c kernel.c
-gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -pie -fno-zero-initialized-in-bss -c kernel_asm.S
-gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -pie -fno-zero-initialized-in-bss -c kernel_syscall.c
-gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -pie -fno-zero-initialized-in-bss -c printf.c
-gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -pie -fno-zero-initialized-in-bss -c fb.c
-gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -pie -fno-zero-initialized-in-bss -c allocator.c
-gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -pie -fno-zero-initialized-in-bss -c ascii_font.c
-gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -pie -fno-zero-initialized-in-bss -c page_table.c
-gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -pie -fno-zero-initialized-in-bss -c slob.c
-gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./kerninc -pie -fno-zero-initialized-in-bss -c list.c
-ld --oformat=binary -T ./kernel.lds -nostdlib -melf_x86_64 -pie kernel_entry.o apic.o kernel.o kernel_asm.o kernel_syscall.o printf.o fb.o allocator.o slob.o ascii_font.o list.o page_table.o -o kernel
+gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -ffreestanding -fno-tree-loop-distribute-patterns -I ./kerninc -pie -fno-zero-initialized-in-bss -c kernel_entry.S
+gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -ffreestanding -fno-tree-loop-distribute-patterns -I ./kerninc -pie -fno-zero-initialized-in-bss -c apic.c
+gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -ffreestanding -fno-tree-loop-distribute-patterns -I ./kerninc -pie -fno-zero-initialized-in-bss -c kernel.c
+gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -ffreestanding -fno-tree-loop-distribute-patterns -I ./kerninc -pie -fno-zero-initialized-in-bss -c kernel_asm.S
+gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -ffreestanding -fno-tree-loop-distribute-patterns -I ./kerninc -pie -fno-zero-initialized-in-bss -c kernel_syscall.c
+gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -ffreestanding -fno-tree-loop-distribute-patterns -I ./kerninc -pie -fno-zero-initialized-in-bss -c printf.c
+gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -ffreestanding -fno-tree-loop-distribute-patterns -I ./kerninc -pie -fno-zero-initialized-in-bss -c fb.c
+gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -ffreestanding -fno-tree-loop-distribute-patterns -I ./kerninc -pie -fno-zero-initialized-in-bss -c allocator.c
+gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -ffreestanding -fno-tree-loop-distribute-patterns -I ./kerninc -pie -fno-zero-initialized-in-bss -c memblock.c
+gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -ffreestanding -fno-tree-loop-distribute-patterns -I ./kerninc -pie -fno-zero-initialized-in-bss -c ascii_font.c
+gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -ffreestanding -fno-tree-loop-distribute-patterns -I ./kerninc -pie -fno-zero-initialized-in-bss -c page_table.c
+gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -ffreestanding -fno-tree-loop-distribute-patterns -I ./kerninc -pie -fno-zero-initialized-in-bss -c slob.c
+gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -ffreestanding -fno-tree-loop-distribute-patterns -I ./kerninc -pie -fno-zero-initialized-in-bss -c list.c
+ld --oformat=binary -T ./kernel.lds -nostdlib -melf_x86_64 -pie kernel_entry.o apic.o kernel.o kernel_asm.o kernel_syscall.o printf.o fb.o allocator.o memblock.o slob.o ascii_font.o list.o page_table.o -o kernel
 
 # Comple the user application
 gcc -Wall -Wno-builtin-declaration-mismatch -O2 -mno-red-zone -nostdinc -fno-stack-protector -I ./userinc -pie -fno-zero-initialized-in-bss -c user_entry.S
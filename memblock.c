@@ -0,0 +1,165 @@
+#include <types.h>
+#include <memblock.h>
+#include <allocator.h>
+#include <printf.h>
+#include <halt.h>
+
+/* usable memory and the parts of it already taken */
+static memblock_type_t memblock_memory;
+static memblock_type_t memblock_reserved;
+static int memblock_released = 0;
+
+/**
+ * Add [base, base + size) to a region set, merging it with every region it overlaps
+ * or touches so the set stays sorted and disjoint. Return 0 on success
+ */
+static int __memblock_insert(memblock_type_t* type, uint64_t base, uint64_t size){
+    uint64_t end = base + size;
+    size_t i, j, k;
+
+    if (!size)
+        return 0;
+
+    // first region that ends at or after base, then every region starting at or before end
+    for (i = 0; i < type->count && type->regions[i].base + type->regions[i].size < base; i++);
+    for (j = i; j < type->count && type->regions[j].base <= end; j++){
+        if (type->regions[j].base < base)
+            base = type->regions[j].base;
+        if (type->regions[j].base + type->regions[j].size > end)
+            end = type->regions[j].base + type->regions[j].size;
+    }
+
+    if (j == i){
+        if (type->count == MEMBLOCK_MAX_REGIONS)
+            return 1;
+        for (k = type->count; k > i; k--)
+            type->regions[k] = type->regions[k - 1];
+        type->count++;
+    }
+    else{
+        // regions i + 1 .. j - 1 were absorbed into region i
+        for (k = 0; j + k < type->count; k++)
+            type->regions[i + 1 + k] = type->regions[j + k];
+        type->count -= j - i - 1;
+    }
+    type->regions[i].base = base;
+    type->regions[i].size = end - base;
+    return 0;
+}
+
+/**
+ * Find the first free range (usable and not reserved) at or after *cursor.
+ * Return 0 when there is none, otherwise fill [start, end) and move the cursor past it
+ */
+static int __next_free(uint64_t* cursor, uint64_t* start, uint64_t* end){
+    memblock_region_t* mem;
+    memblock_region_t* res;
+    uint64_t s, e;
+    size_t i, j;
+
+    for (i = 0; i < memblock_memory.count; i++){
+        mem = &memblock_memory.regions[i];
+        if (mem->base + mem->size <= *cursor)
+            continue;
+
+        s = mem->base > *cursor ? mem->base : *cursor;
+        e = mem->base + mem->size;
+        // reserved regions are sorted and never touch, so one pass skips or clips them
+        for (j = 0; j < memblock_reserved.count; j++){
+            res = &memblock_reserved.regions[j];
+            if (res->base + res->size <= s)
+                continue;
+            if (res->base <= s){
+                s = res->base + res->size;
+                continue;
+            }
+            if (res->base < e)
+                e = res->base;
+            break;
+        }
+        if (s >= e)
+            continue;
+
+        *start = s;
+        *end = e;
+        *cursor = e;
+        return 1;
+    }
+    return 0;
+}
+
+void memblock_init(efi_memory_descriptor_t* memory_map, uint64_t memory_map_size, uint64_t memory_map_desc_size){
+    memblock_memory.count = 0;
+    memblock_reserved.count = 0;
+    memblock_released = 0;
+
+    for (uint64_t i = 0; i < memory_map_size / memory_map_desc_size; i++){
+        efi_memory_descriptor_t* desc = (efi_memory_descriptor_t*)((uint64_t)memory_map + (i * memory_map_desc_size));
+        if (desc->type == EFI_CONVENTIONAL_MEMORY && memblock_add((uint64_t)desc->physical_addr, desc->num_pages * PAGESIZE))
+            HALT("[!] memblock_init(): too many memory regions!\n");
+    }
+
+    // page 0 doubles as NULL, it is never handed out
+    memblock_reserve(0, PAGESIZE);
+}
+
+int memblock_add(uint64_t base, uint64_t size){
+    return __memblock_insert(&memblock_memory, base, size);
+}
+
+int memblock_reserve(uint64_t base, uint64_t size){
+    uint64_t end = (base + size + PAGESIZE - 1) & ~(PAGESIZE - 1);
+
+    base &= ~(PAGESIZE - 1);
+    if (__memblock_insert(&memblock_reserved, base, end - base))
+        HALT("[!] memblock_reserve(): too many reserved regions!\n");
+    return 0;
+}
+
+/* First fit, lowest address first */
+void* memblock_alloc(size_t num_pages){
+    uint64_t cursor = 0, start, end;
+
+    if (memblock_released || !num_pages)
+        return NULL;
+    while (__next_free(&cursor, &start, &end)){
+        if (end - start >= num_pages * PAGESIZE){
+            memblock_reserve(start, num_pages * PAGESIZE);
+            return (void*)start;
+        }
+    }
+    return NULL;
+}
+
+void memblock_for_each_reserved(void (*fn)(uint64_t addr, uint64_t num_pages)){
+    for (size_t i = 0; i < memblock_reserved.count; i++)
+        fn(memblock_reserved.regions[i].base, memblock_reserved.regions[i].size / PAGESIZE);
+}
+
+size_t memblock_release(void (*release)(uint64_t addr, uint64_t num_pages)){
+    uint64_t cursor = 0, start, end;
+    size_t released = 0;
+
+    if (memblock_released)
+        HALT("[!] memblock_release(): early memory was already released!\n");
+    memblock_released = 1;
+
+    while (__next_free(&cursor, &start, &end)){
+        release(start, (end - start) / PAGESIZE);
+        released += (end - start) / PAGESIZE;
+    }
+    return released;
+}
+
+void memblock_dump(){
+    size_t i;
+
+    printf("[?] memblock memory: %d regions\n", memblock_memory.count);
+    for (i = 0; i < memblock_memory.count; i++)
+        printf("\t[%p - %p)\n", (void*)memblock_memory.regions[i].base,
+               (void*)(memblock_memory.regions[i].base + memblock_memory.regions[i].size));
+    printf("[?] memblock reserved: %d regions\n", memblock_reserved.count);
+    for (i = 0; i < memblock_reserved.count; i++)
+        printf("\t[%p - %p)\n", (void*)memblock_reserved.regions[i].base,
+               (void*)(memblock_reserved.regions[i].base + memblock_reserved.regions[i].size));
+}
@@ -3,11 +3,33 @@
 #define TAGSIZE sizeof(boundary_block_t)
 #define PRINT(msg) __syscall1(0, (long)msg)
 #define PRINTF(msg, a) __syscall2(3, (long)msg, a)
+#define ALIGNMENT 8 /*payload sizes are rounded up to this, so free list links stay aligned*/
+#define NUM_FREE_LISTS 20 /*size classes of the segregated free lists*/
 /* private variables */
 static char *mem_start_brk = NULL;  /* points to first byte of heap */
 static char *mem_brk = NULL;        /* points to last byte of heap */
 static char *mem_max_addr = NULL;   /* largest legal heap address */
 
+/* |header||next|prev|...|footer|, a free block keeps its list links in its payload.
+ * Links are offsets from mem_start_brk (0 for none) so they and the footer fit MIN_BLOCK_SIZE */
+typedef struct free_links{
+    uint32_t next;
+    uint32_t prev;
+}free_links_t;
+
+/* free_lists[i] holds free blocks of MIN_BLOCK_SIZE << i bytes or more, the last list everything bigger */
+static boundary_block_t* free_lists[NUM_FREE_LISTS];
+static boundary_block_t* rovers[NUM_FREE_LISTS]; /* where next fit resumes in each list */
+static int policy = MM_POLICY;
+static const char* policy_names[MM_NUM_POLICIES] = {"first fit", "next fit", "best fit", "address-ordered first fit"};
+
+/* statistics since memlib_init */
+static size_t num_mallocs;
+static size_t num_frees;
+static size_t search_steps; /* free blocks looked at by find_block */
+static size_t live_bytes; /* payload of the allocated blocks */
+static size_t peak_live_bytes;
+
 /*
  *    Extends the heap by incr bytes and returns the start address of the new 
  *    area. The heap cannot be shrunk.
@@ -29,75 +51,161 @@ static void* get_payload(boundary_block_t* cur_block){
     return (void*)(((char*)cur_block) + TAGSIZE);
 }
 
-/* |header||payload||footer||next_block_header|.... */
+/* |header||payload||next_block_header|.... */
 static boundary_block_t* get_next(boundary_block_t* cur_block){
     if((void*)cur_block == mem_brk - TAGSIZE) // tail case
         return NULL;
-    if((void*)cur_block == mem_start_brk) return cur_block + 1; // head case
-    return (boundary_block_t*)(((char*)cur_block) + cur_block->size + TAGSIZE*2);
+    return (boundary_block_t*)(((char*)cur_block) + cur_block->size + TAGSIZE);
 }
 
-/* |prev_block_header||prev_block_payload||prev_block_footer||header|.... */
+/* |prev_block_header||prev_block_payload...prev_block_footer||header|...., only if prev is free */
 static boundary_block_t* get_prev(boundary_block_t* cur_block){
-    if((void*)cur_block == mem_start_brk) // head case
+    if((void*)cur_block == mem_start_brk || cur_block->prev_alloc) // head case, or no footer
         return NULL;
 
     boundary_block_t* prev_footer = (boundary_block_t*)(((char*)cur_block) - TAGSIZE);
-    return (boundary_block_t*)(((char*)cur_block) - TAGSIZE*2 - prev_footer->size);
+    return (boundary_block_t*)(((char*)cur_block) - TAGSIZE - prev_footer->size);
 }
 
-/* |header||payload||footer| */
+/* |header||payload...footer|, the last word of a free block's payload */
 static boundary_block_t* get_footer(boundary_block_t* cur_block){
-    return (boundary_block_t*)(((char*)cur_block) + TAGSIZE + cur_block->size);
+    return (boundary_block_t*)(((char*)cur_block) + cur_block->size);
+}
+
+static free_links_t* get_links(boundary_block_t* cur_block){
+    return (free_links_t*)get_payload(cur_block);
+}
+
+static boundary_block_t* from_link(uint32_t link){
+    return link ? (boundary_block_t*)(mem_start_brk + link) : NULL;
+}
+
+static uint32_t to_link(boundary_block_t* cur_block){
+    return cur_block ? (uint32_t)((char*)cur_block - mem_start_brk) : 0;
+}
+
+/*Size class of a block of the given payload size*/
+static int get_class(size_t size){
+    int i = 0;
+    while(i < NUM_FREE_LISTS - 1 && size >= (MIN_BLOCK_SIZE << (i + 1)))
+        i++;
+    return i;
+}
+
+/*does a free block go before another in its list under the current policy*/
+static int goes_before(boundary_block_t* cur_block, boundary_block_t* other){
+    if(policy == MM_BEST_FIT)
+        return cur_block->size <= other->size;
+    if(policy == MM_ADDRESS_ORDERED)
+        return cur_block < other;
+    return 1;
+}
+
+/*put a free block on the list of its size class, in policy order*/
+static void insert_free(boundary_block_t* cur_block){
+    boundary_block_t** head = &free_lists[get_class(cur_block->size)];
+    boundary_block_t* prev = NULL;
+    boundary_block_t* next = *head;
+
+    while(next && !goes_before(cur_block, next)){
+        prev = next;
+        next = from_link(get_links(next)->next);
+    }
+    get_links(cur_block)->prev = to_link(prev);
+    get_links(cur_block)->next = to_link(next);
+    if(next)
+        get_links(next)->prev = to_link(cur_block);
+    if(prev)
+        get_links(prev)->next = to_link(cur_block);
+    else
+        *head = cur_block;
+}
+
+/*unlink a free block from the list of its size class*/
+static void remove_free(boundary_block_t* cur_block){
+    free_links_t* links = get_links(cur_block);
+    int class = get_class(cur_block->size);
+
+    if(rovers[class] == cur_block)
+        rovers[class] = from_link(links->next);
+    if(links->prev)
+        get_links(from_link(links->prev))->next = links->next;
+    else
+        free_lists[class] = from_link(links->next);
+    if(links->next)
+        get_links(from_link(links->next))->prev = links->prev;
 }
 
-/*First fit for block*/
+/*
+ * First fit within each list from the request's size class up, so the list order set by
+ * the policy decides which block is taken. Next fit starts each list at its rover and wraps
+ */
 static boundary_block_t* find_block(size_t size){
     boundary_block_t* cur_block;
-    for(cur_block = (boundary_block_t*)mem_start_brk; cur_block != NULL; cur_block = get_next(cur_block)){
-        if (cur_block->free && cur_block->size >= size) return cur_block;
+    boundary_block_t* start;
+    for(int i = get_class(size); i < NUM_FREE_LISTS; i++){
+        start = (policy == MM_NEXT_FIT && rovers[i]) ? rovers[i] : free_lists[i];
+        for(cur_block = start; cur_block != NULL && cur_block->size < size; cur_block = from_link(get_links(cur_block)->next))
+            search_steps++;
+        if(cur_block == NULL){ // wrap around to the blocks before the rover
+            for(cur_block = free_lists[i]; cur_block != start && cur_block->size < size; cur_block = from_link(get_links(cur_block)->next))
+                search_steps++;
+            if(cur_block == start)
+                continue;
+        }
+        search_steps++;
+        if(policy == MM_NEXT_FIT)
+            rovers[i] = from_link(get_links(cur_block)->next);
+        return cur_block;
     }
     return NULL;
 }
 
-/*mark header and footer as used*/
+/*mark header as used and tell the next block it has no footer before it*/
 static void mark_used(boundary_block_t* cur_block, size_t size){
     cur_block->free = 0;
     cur_block->size = size;
-    get_footer(cur_block)->free = 0;
-    get_footer(cur_block)->size = size;
+    get_next(cur_block)->prev_alloc = 1;
 }
 
-/*mark header and footer as free*/
+/*mark header and footer as free and tell the next block it can coalesce backwards*/
 static void mark_free(boundary_block_t* cur_block, size_t size){
     cur_block->free = 1;
     cur_block->size = size;
     get_footer(cur_block)->free = 1;
     get_footer(cur_block)->size = size;
+    get_next(cur_block)->prev_alloc = 0;
 }
 
 
+/*the new block is marked free but is on no free list*/
 boundary_block_t* extend_heap(size_t size){
-    size_t to_extend = max(size + 2*TAGSIZE, MIN_BLOCK_SIZE);
-    boundary_block_t* new_last_block = (boundary_block_t*)((char*)mem_sbrk(to_extend) - TAGSIZE);
+    size_t to_extend = max(size + TAGSIZE, MIN_BLOCK_SIZE);
+    char* old_brk = (char*)mem_sbrk(to_extend);
+    if(old_brk == NULL)
+        return NULL;
+    // the new block takes over the last fence, keeping its prev_alloc bit
+    boundary_block_t* new_last_block = (boundary_block_t*)(old_brk - TAGSIZE);
     //__syscall2(3, (long)"[?] extend heap: new last block => %p\n", (long)(new_last_block));
-    mark_free(new_last_block, size);
+    new_last_block->size = size;
     get_next(new_last_block)->free = 0;
     get_next(new_last_block)->size = 0;
+    mark_free(new_last_block, size);
     return new_last_block;
 }
 
 
 // whats left after split is bigger than min block size
-// whats left = old_size - to_use - 2*TAGSIZE
+// whats left = old_size - to_use - TAGSIZE, the allocated part keeps no footer
 // if whats left >= minblocksize > split
 static void split(boundary_block_t* cur_block, int to_use){
     int old_size = (int)cur_block->size;
-    int split_size = max(0,((int)old_size) - to_use - ((int)TAGSIZE) - ((int)TAGSIZE));
+    int split_size = max(0,((int)old_size) - to_use - ((int)TAGSIZE));
 
     if (split_size > MIN_BLOCK_SIZE){
         mark_used(cur_block, to_use);
         mark_free(get_next(cur_block), split_size);
+        insert_free(get_next(cur_block));
     }
     else{
         mark_used(cur_block, old_size);
@@ -108,8 +216,9 @@ static void split(boundary_block_t* cur_block, int to_use){
 /*mark header and footer as free*/
 static void coalesce(boundary_block_t* cur_block){
     int prev_free, prev_size, next_free, next_size;
+    boundary_block_t* merged = cur_block;
 
-    if( (cur_block - 1)->size == 0){ // first fence check
+    if(cur_block->prev_alloc){ // also true after the first fence
         prev_free = 0;
         prev_size = 0;
     }
@@ -120,53 +229,72 @@ static void coalesce(boundary_block_t* cur_block){
     next_free = get_next(cur_block)->free;
     next_size = get_next(cur_block)->size;
 
+    // neighbours merged into this block leave their lists, the result joins its own
+    if(prev_free)
+        remove_free(get_prev(cur_block));
+    if(next_free)
+        remove_free(get_next(cur_block));
+
     if(prev_free && next_free)
-        /*|prev_head|prev_payload|prev_footer||cur_head|cur_payload|cur_footer||nxt_head|nxt_payload|nxt_footer|*/
+        /*|prev_head|prev_payload|prev_footer||cur_head|cur_payload||nxt_head|nxt_payload|nxt_footer|*/
         /*|head|payload|foot|*/
-        mark_free(get_prev(cur_block), prev_size + next_size + cur_block->size + TAGSIZE * 4);
+        mark_free(merged = get_prev(cur_block), prev_size + next_size + cur_block->size + TAGSIZE * 2);
     else if(prev_free)
-        /*|prev_head|prev_payload|prev_footer||cur_head|cur_payload|cur_footer|*/
+        /*|prev_head|prev_payload|prev_footer||cur_head|cur_payload|*/
         /*|head|payload|foot|*/
-        mark_free(get_prev(cur_block), prev_size + cur_block->size + TAGSIZE * 2);
+        mark_free(merged = get_prev(cur_block), prev_size + cur_block->size + TAGSIZE);
     else if(next_free)
-        /*|cur_head|cur_payload|cur_footer||nxt_head|nxt_payload|nxt_footer|*/
+        /*|cur_head|cur_payload||nxt_head|nxt_payload|nxt_footer|*/
         /*|head|payload|foot|*/
-        mark_free(cur_block, next_size + cur_block->size + TAGSIZE * 2);
+        mark_free(cur_block, next_size + cur_block->size + TAGSIZE);
     else
         mark_free(cur_block, cur_block->size);
+    insert_free(merged);
 }
 
 /*
  * mem_init - initialize the memory system model
  */
-void memlib_init(void)
+void memlib_init(int new_policy)
 {
     __syscall1(0, (long)"[?] In memlib_init()\n");
-    mem_start_brk = (char*) __syscall1(1, MAX_HEAP / PAGESIZE + 1); /*request memory up front*/
+    if(!mem_start_brk)
+        mem_start_brk = (char*) __syscall1(1, MAX_HEAP / PAGESIZE + 1); /*request memory up front*/
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    for(int i = 0; i < NUM_FREE_LISTS; i++){
+        free_lists[i] = NULL;
+        rovers[i] = NULL;
+    }
+    policy = (new_policy >= 0 && new_policy < MM_NUM_POLICIES) ? new_policy : MM_POLICY;
+    num_mallocs = num_frees = search_steps = live_bytes = peak_live_bytes = 0;
 
     //initial sbrk call and stick fences in there
     boundary_block_t* initial = (boundary_block_t* )mem_sbrk(MIN_BLOCK_SIZE);
     initial[0].size = 0;
     initial[0].free = 0;
+    initial[0].prev_alloc = 1;
     initial[1].size = 0;
     initial[1].free = 0;
+    initial[1].prev_alloc = 1;
 }
 
 void * mm_malloc(size_t size){
     if(!mem_max_addr){
         __syscall1(0, (long)"[?] mm_malloc: calling memlib_init!\n");
-        memlib_init();
+        memlib_init(MM_POLICY);
     }
 
     if (!size)
         return NULL;
 
     size = max(MIN_BLOCK_SIZE, size);
+    size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
     boundary_block_t *cur_block = find_block(size);
 
-    if (cur_block == NULL){
+    if (cur_block != NULL)
+        remove_free(cur_block);
+    else{
         //no fit found grow the heap
         cur_block = extend_heap(size);
         if (cur_block == NULL){
@@ -175,12 +303,17 @@ void * mm_malloc(size_t size){
         }
     }
     split(cur_block, size);
+
+    num_mallocs++;
+    live_bytes += cur_block->size;
+    if(live_bytes > peak_live_bytes)
+        peak_live_bytes = live_bytes;
     return get_payload(cur_block);
 }
 
 void * mm_realloc(void *addr, size_t size){
     if(!mem_max_addr)
-        memlib_init();
+        memlib_init(MM_POLICY);
 
     if (!size)
         return NULL;
@@ -192,9 +325,24 @@ void * mm_realloc(void *addr, size_t size){
 void mm_free(void *addr){
     if(!addr) return;
     boundary_block_t *cur_block = (boundary_block_t *)(((char*)addr) - TAGSIZE);
+    num_frees++;
+    live_bytes -= cur_block->size;
     coalesce(cur_block);
 }
 
+void mm_print_stats(void){
+    size_t heap = mem_brk - mem_start_brk;
+
+    PRINTF("[?] Heap placement: %s\n", (long)policy_names[policy]);
+    PRINTF("\tmallocs: %d, ", num_mallocs);
+    PRINTF("frees: %d\n", num_frees);
+    PRINTF("\tfree blocks searched per malloc: %d\n", num_mallocs ? search_steps / num_mallocs : 0);
+    PRINTF("\theap: %d b, ", heap);
+    PRINTF("peak payload: %d b, ", peak_live_bytes);
+    // what the heap grew to past the most it ever held, i.e. lost to fragmentation and tags
+    PRINTF("fragmentation: %d%%\n", heap ? 100 - peak_live_bytes * 100 / heap : 0);
+}
+
 /* Debug the heap from user_space */
 void debug_heap_user(){
     PRINT("[?] Debugging user heap...\n");
@@ -215,7 +363,7 @@ void debug_heap_user(){
         PRINTF("%p, ", (uint64_t)tmp);
         PRINTF("size: %d, ", tmp->size);
         PRINTF("%d\n", tmp->free);
-        ptr += (tmp->size + TAGSIZE * 2);
+        ptr += (tmp->size + TAGSIZE);
         tmp = (boundary_block_t*)ptr;
     }
     PRINT("[?] Done debugging user heap...\n");
@@ -82,6 +82,23 @@ void clear_page(void* addr){
     __builtin_memset(addr, 0, PAGESIZE);
 }
 
+void clear_page_nt(void* addr){
+    uint64_t* ptr = (uint64_t*)addr;
+    for(uint64_t i = 0; i < PAGESIZE / sizeof(uint64_t); i += 4){
+        asm volatile("movnti %1, 0(%0)\n\t"
+                     "movnti %1, 8(%0)\n\t"
+                     "movnti %1, 16(%0)\n\t"
+                     "movnti %1, 24(%0)"
+                     : : "r"(ptr + i), "r"(0ULL) : "memory");
+    }
+    asm volatile("sfence" : : : "memory");
+}
+
+void clear_pages(void* addr, size_t num_pages){
+    size_t count = num_pages * PAGESIZE;
+    asm volatile("rep stosb" : "+D"(addr), "+c"(count) : "a"(0) : "memory");
+}
+
 int map_memory(page_pml_t* pml4, void* virtual_addr, void* physical_addr, int usermode){
     page_table_indexer_t indexes;
     void* temp_addr;
@@ -93,25 +110,22 @@ int map_memory(page_pml_t* pml4, void* virtual_addr, void* physical_addr, int us
 
     if(!pml4[indexes.pml_idx].present){
         //create entry
-        if(!(temp_addr = get_block(1)))
+        if(!(temp_addr = get_zeroed_block(1)))
             return 2;
-        clear_page(temp_addr);
         set_pml(pml4, indexes.pml_idx, (uint64_t)temp_addr >> PAGESHIFT, 1, usermode);
     }
     page_pdpe_t* pdpe = (page_pdpe_t*)((uint64_t)(pml4[indexes.pml_idx].page_address) << PAGESHIFT);
     if(!pdpe[indexes.pdpe_idx].present){
         //create entry
-        if(!(temp_addr = get_block(1)))
+        if(!(temp_addr = get_zeroed_block(1)))
             return 3;
-        clear_page(temp_addr);
         set_pdpe(pdpe, indexes.pdpe_idx, (uint64_t)temp_addr >> PAGESHIFT, 1, usermode);
     }
     page_pde_t* pde = (page_pde_t*)((uint64_t)(pdpe[indexes.pdpe_idx].page_address) << PAGESHIFT);
     if(!pde[indexes.pde_idx].present){
         //create entry
-        if(!(temp_addr = get_block(1)))
+        if(!(temp_addr = get_zeroed_block(1)))
             return 4;
-        clear_page(temp_addr);
         set_pde(pde, indexes.pde_idx, (uint64_t)temp_addr >> PAGESHIFT, 1, usermode);
     }
     page_pte_t* pte = (page_pte_t*)((uint64_t)(pde[indexes.pde_idx].page_address) << PAGESHIFT);
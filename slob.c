@@ -1,146 +1,794 @@
 #include <slob.h>
 
-list_t slob_lists[3];
-static size_t slob_sizes[3] = {256, 1024, PAGESIZE};
+/* slabs never grow past this many pages */
+#define SLAB_MAX_PAGES 8
+/* room taken by the slab header, objects start right after it */
+#define SLAB_HEADER_SIZE ((sizeof(kmem_slab_t) + 7) & ~7ULL)
+/* distance from the start of a large allocation to the object, keeps it 16 byte aligned */
+#define LARGE_HEADER_SIZE ((sizeof(kmalloc_large_t) + 15) & ~15ULL)
+/* page frames covered by one leaf page of the slab page-frame table */
+#define SLAB_MAP_ENTRIES (PAGESIZE / sizeof(kmem_slab_t*))
 
-/* address ranges for each list. Used to naively for list membership when freeing */
-static void* small_slob_bounds[2];
-static void* medium_slob_bounds[2];
-static void* large_slob_bounds[2];
+/* size classes, in small steps where most requests land */
+static const size_t kmalloc_sizes[] = {8, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048};
+#define NUM_KMALLOC_CACHES (sizeof(kmalloc_sizes) / sizeof(kmalloc_sizes[0]))
+static const char* kmalloc_names[NUM_KMALLOC_CACHES] = {
+    "kmalloc-8", "kmalloc-16", "kmalloc-24", "kmalloc-32", "kmalloc-48", "kmalloc-64",
+    "kmalloc-96", "kmalloc-128", "kmalloc-192", "kmalloc-256", "kmalloc-384", "kmalloc-512",
+    "kmalloc-768", "kmalloc-1024", "kmalloc-1536", "kmalloc-2048"
+};
 
+static kmem_cache_t kmalloc_caches[NUM_KMALLOC_CACHES];
+static int slob_ready = 0;
+static int slab_coloring = 1;
 
-static void __init_slob_list(void* base_addr, size_t num_pages, slob_type_t slob_type){
-    list_t* list = &slob_lists[slob_type];
-    uint64_t i;
-    slob_blk_t* blk;
-    uint64_t addr = (uint64_t) base_addr;
+/* large allocations and krealloc() outcomes */
+static size_t large_allocs;
+static size_t large_frees;
+static size_t large_pages; //pages held by live large allocations
+static size_t realloc_in_place;
+static size_t realloc_moved;
 
-    list_init(&slob_lists[slob_type]);
+/* every cache, and the cache the descriptors of kmem_cache_create() caches come from */
+static list_t cache_list;
+static spinlock_t cache_list_lock;
+static kmem_cache_t cache_cache;
 
-    switch(slob_type){
-        case SMALL:
-            small_slob_bounds[0] = base_addr;
-            small_slob_bounds[1] = base_addr + num_pages * PAGESIZE;
-        break;
-        case MEDIUM:
-            medium_slob_bounds[0] = base_addr;
-            medium_slob_bounds[1] = base_addr + num_pages * PAGESIZE;
-        break;
-        case LARGE:
-            large_slob_bounds[0] = base_addr;
-            large_slob_bounds[1] = base_addr + num_pages * PAGESIZE;
-        break;
-        default:;
+/* cache the magazines themselves are carved from, straight from its slabs */
+static kmem_cache_t* magazine_cache;
+/* set while a CPU works on its magazines, so a shrinker run by an allocation failing under them
+ * leaves them alone. The timer tick never runs the shrinker in kernel mode */
+static volatile int magazines_busy[MAX_CPUS];
+
+/* page frame -> slab holding it: a directory of leaf pages, each allocated once a slab lands in
+ * its range. Slabs share pageblocks, so only a handful of leaves ever exist */
+static kmem_slab_t*** slab_map;
+static size_t slab_map_leaves;
+
+static void __zero(void* addr, size_t size){
+    asm volatile("rep stosb" : "+D"(addr), "+c"(size) : "a"(0) : "memory");
+}
+
+static void __copy(void* dst, const void* src, size_t size){
+    asm volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(size) : : "memory");
+}
+
+/* Smallest size class holding size bytes */
+static kmem_cache_t* __size_cache(size_t size){
+    size_t i;
+
+    for(i = 0; kmalloc_sizes[i] < size; i++);
+    return &kmalloc_caches[i];
+}
+
+/* Link of a free object to the next one */
+static inline void** __free_link(kmem_cache_t* cache, void* obj){
+    return (void**)((char*)obj + cache->offset);
+}
+
+/**
+ * Set up a cache, with the smallest slab that wastes at most an eighth of itself.
+ * Objects with a constructor keep their free list link past the object so it never
+ * clobbers constructed state. Return 0 on success, 1 if an object does not fit a slab
+ */
+static int __cache_init(kmem_cache_t* cache, const char* name, size_t size, size_t align, kmem_ctor_t ctor){
+    size_t i, pages, header;
+
+    if(!align)
+        align = sizeof(void*);
+    if(align & (align - 1) || align < sizeof(void*) || align > PAGESIZE)
+        return 1;
+    cache->offset = ctor ? (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1) : 0;
+    cache->stride = (ctor ? cache->offset + sizeof(void*) : size > sizeof(void*) ? size : sizeof(void*));
+    cache->stride = (cache->stride + align - 1) & ~(align - 1);
+    // objects start on the first aligned address past the slab header
+    header = (SLAB_HEADER_SIZE + align - 1) & ~(align - 1);
+    if(header + cache->stride > SLAB_MAX_PAGES * PAGESIZE)
+        return 1;
+
+    for(pages = 1; pages < SLAB_MAX_PAGES; pages <<= 1){
+        if(pages * PAGESIZE >= header + cache->stride &&
+           ((pages * PAGESIZE - header) % cache->stride + header) * 8 <= pages * PAGESIZE)
+            break;
+    }
+    cache->name = name;
+    cache->size = size;
+    cache->align = align;
+    cache->ctor = ctor;
+    cache->slab_pages = pages;
+    cache->num = (pages * PAGESIZE - header) / cache->stride;
+    // the space left after the last object shifts each new slab by one more cache line
+    cache->color_off = align > SLAB_CACHE_LINE ? align : SLAB_CACHE_LINE;
+    cache->colors = (pages * PAGESIZE - header - cache->num * cache->stride) / cache->color_off + 1;
+    cache->color_next = 0;
+    for(i = 0; i < MAX_CPUS; i++){
+        cache->cpu[i].loaded = NULL;
+        cache->cpu[i].previous = NULL;
+        cache->cpu[i].remote_slabs = NULL;
+        cache->cpu[i].hits = 0;
+        cache->cpu[i].misses = 0;
+        cache->cpu[i].remote_frees = 0;
+        cache->cpu[i].remote_collected = 0;
     }
+    spin_lock_init(&cache->depot_lock);
+    list_init(&cache->depot_full);
+    list_init(&cache->depot_empty);
+    cache->depot_exchanges = 0;
+    spin_lock_init(&cache->lock);
+    list_init(&cache->slabs_full);
+    list_init(&cache->slabs_partial);
+    list_init(&cache->slabs_empty);
+    cache->num_slabs = 0;
+    cache->allocs = 0;
+    cache->frees = 0;
+    cache->requested = 0;
+    cache->reaped = 0;
+    spin_lock(&cache_list_lock);
+    list_push_back(&cache_list, &cache->elem);
+    spin_unlock(&cache_list_lock);
+    return 0;
+}
+
+/* Slab map entry of a page frame, allocating its leaf if create is set. NULL when there is none */
+static kmem_slab_t** __slab_map_entry(uint64_t frame, int create){
+    size_t leaf = frame / SLAB_MAP_ENTRIES;
 
-    for(i = addr; i < addr + (num_pages * PAGESIZE); i += slob_sizes[slob_type]){
-        blk = (slob_blk_t*)i;
-        blk->size = slob_sizes[slob_type];
-        list_push_back(list, &blk->elem);
+    if(leaf >= slab_map_leaves)
+        return NULL;
+    if(!slab_map[leaf] && (!create || !(slab_map[leaf] = get_zeroed_block(1))))
+        return NULL;
+    return &slab_map[leaf][frame % SLAB_MAP_ENTRIES];
+}
+
+/* Slab holding addr, in constant time. NULL when addr is not in a slab */
+static kmem_slab_t* __find_slab(void* addr){
+    kmem_slab_t** entry;
+
+    if(!slob_ready || !(entry = __slab_map_entry((uint64_t)addr >> PAGESHIFT, 0)))
+        return NULL;
+    return *entry;
+}
+
+/* Halt unless addr is the start of one of the slab's objects */
+static void __check_object(kmem_slab_t* slab, void* addr){
+    kmem_cache_t* cache = slab->cache;
+    size_t index = ((char*)addr - (char*)slab->base) / cache->stride;
+
+    if((char*)addr < (char*)slab->base || index >= cache->num ||
+       (char*)addr != (char*)slab->base + index * cache->stride)
+        HALT("[!] kfree(): pointer is not the start of an object!\n");
+}
+
+/**
+ * ####################
+ *  SLAB LAYER
+ * ####################
+ */
+
+/* Carve a new slab for a cache out of a buddy block. Called without the slab lock held,
+ * since the buddy system may run the shrinker. Return 0 when out of memory */
+static int __cache_grow(kmem_cache_t* cache){
+    kmem_slab_t* slab = get_block_mobility(cache->slab_pages, MIGRATE_RECLAIMABLE);
+    kmem_slab_t** entry;
+    char* obj;
+    size_t i;
+
+    if(!slab)
+        return 0;
+    // slabs are aligned to their size, so all of a slab's pages share one leaf
+    if(!(entry = __slab_map_entry((uint64_t)slab >> PAGESHIFT, 1))){
+        free_block(slab);
+        return 0;
+    }
+    for(i = 0; i < cache->slab_pages; i++)
+        entry[i] = slab;
+
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->owner = this_cpu();
+    slab->remote_free = NULL;
+    slab->remote_next = NULL;
+    slab->base = (char*)(((uint64_t)slab + SLAB_HEADER_SIZE + cache->align - 1) & ~(cache->align - 1));
+    if(slab_coloring){
+        // slabs are page aligned, so without this their first objects all land in the same cache sets
+        slab->base = (char*)slab->base + cache->color_next * cache->color_off;
+        cache->color_next = (cache->color_next + 1) % cache->colors;
     }
+    slab->free = NULL;
+    // link the objects back to front so they are handed out in address order
+    for(i = cache->num; i-- > 0;){
+        obj = (char*)slab->base + i * cache->stride;
+        if(cache->ctor)
+            cache->ctor(obj);
+        *__free_link(cache, obj) = slab->free;
+        slab->free = obj;
+    }
+
+    spin_lock(&cache->lock);
+    list_push_front(&cache->slabs_empty, &slab->elem);
+    cache->num_slabs++;
+    spin_unlock(&cache->lock);
+    return 1;
 }
 
+/* Give an empty slab, already off its list, back to the buddy system */
+static void __slab_destroy(kmem_slab_t* slab){
+    kmem_cache_t* cache = slab->cache;
+    kmem_slab_t** entry = __slab_map_entry((uint64_t)slab >> PAGESHIFT, 0);
+    size_t i;
 
-void slob_init(size_t num_pages){
-    if (num_pages < 3) HALT("Num pages given to slob allocator is less than 3. We got problems \n");
-    size_t smol_pages = num_pages / 3;
-    size_t big_pages = num_pages / 3;
-    size_t chunky_pages = num_pages / 3;
-    void* addr;
-    // initalize free lists
-    //loop through each free list, adding all blocks to respective list
-    if (! (addr = get_block(smol_pages))) HALT("slob_init: Failed to alloc small slob list");
-    __init_slob_list(addr, smol_pages, SMALL);
-    if (! (addr = get_block(big_pages))) HALT("slob_init: Failed to alloc medium slob list");
-    __init_slob_list(addr, big_pages, MEDIUM);
-    if (! (addr = get_block(chunky_pages))) HALT("slob_init: Failed to alloc large slob list");
-    __init_slob_list(addr, chunky_pages, LARGE);
+    for(i = 0; i < cache->slab_pages; i++)
+        entry[i] = NULL;
+    cache->num_slabs--;
+    free_block(slab);
 }
 
+/* Take an object from a partially used slab, then an empty one, growing the cache if needed */
+static void* __slab_alloc(kmem_cache_t* cache){
+    kmem_slab_t* slab;
+    void* obj;
 
-void *__slob_alloc(size_t size){
-    //traverse list based on size range
-    slob_type_t slob_size;
-    if(size <= 256) slob_size = SMALL;
-    else if (size <= 1024)slob_size = MEDIUM;
-    else if(size <= PAGESIZE) slob_size = LARGE;
-    else return NULL;
+    spin_lock(&cache->lock);
+    while(list_empty(&cache->slabs_partial) && list_empty(&cache->slabs_empty)){
+        spin_unlock(&cache->lock);
+        if(!__cache_grow(cache))
+            return NULL;
+        spin_lock(&cache->lock);
+    }
+    if(!list_empty(&cache->slabs_partial))
+        slab = list_entry(list_front(&cache->slabs_partial), kmem_slab_t, elem);
+    else
+        slab = list_entry(list_front(&cache->slabs_empty), kmem_slab_t, elem);
 
-    list_elem_t* e;
-    if(list_empty(&slob_lists[slob_size])){
+    obj = slab->free;
+    slab->free = *__free_link(cache, obj);
+    if(!slab->inuse++){
+        list_remove(&slab->elem);
+        list_push_front(&cache->slabs_partial, &slab->elem);
+    }
+    if(slab->inuse == cache->num){
+        list_remove(&slab->elem);
+        list_push_front(&cache->slabs_full, &slab->elem);
+    }
+    spin_unlock(&cache->lock);
+    return obj;
+}
+
+/* Put an object back on its slab's free list, with the slab lock held.
+ * Empty slabs are kept until the cache is shrunk */
+static void __slab_put(kmem_slab_t* slab, void* addr){
+    kmem_cache_t* cache = slab->cache;
+
+    *__free_link(cache, addr) = slab->free;
+    slab->free = addr;
+    if(slab->inuse-- == cache->num){
+        list_remove(&slab->elem);
+        list_push_front(&cache->slabs_partial, &slab->elem);
+    }
+    if(!slab->inuse){
+        list_remove(&slab->elem);
+        list_push_front(&cache->slabs_empty, &slab->elem);
+    }
+}
+
+static void __slab_free(kmem_slab_t* slab, void* addr){
+    spin_lock(&slab->cache->lock);
+    __slab_put(slab, addr);
+    spin_unlock(&slab->cache->lock);
+}
+
+/**
+ * ####################
+ *  REMOTE FREES
+ * ####################
+ */
+
+/**
+ * Free an object to a slab another CPU owns, with no lock: push it on the slab's remote
+ * list and, if that list was empty, push the slab on its owner's list of slabs to collect.
+ * Until then nobody can take the object, so the slab cannot go away under us
+ */
+static void __remote_free(kmem_slab_t* slab, void* addr){
+    kmem_cpu_cache_t* owner = &slab->cache->cpu[slab->owner];
+    void* head = slab->remote_free;
+    kmem_slab_t* slabs;
+
+    do{
+        *__free_link(slab->cache, addr) = head;
+    } while(!__atomic_compare_exchange_n(&slab->remote_free, &head, addr, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if(head)
+        return;
+
+    slabs = owner->remote_slabs;
+    do{
+        slab->remote_next = slabs;
+    } while(!__atomic_compare_exchange_n(&owner->remote_slabs, &slabs, slab, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * Take every object other CPUs freed to a CPU's slabs, with the slab lock held. They fill
+ * mag (if any) and the rest go back to their slabs. The lists are swapped out whole, so a
+ * slab pushed again while we walk it only gets picked up next time
+ */
+static void __remote_collect(kmem_cache_t* cache, kmem_cpu_cache_t* cc, kmem_magazine_t* mag){
+    kmem_slab_t* slab = __atomic_exchange_n(&cc->remote_slabs, NULL, __ATOMIC_ACQUIRE);
+    kmem_slab_t* next;
+    void* obj;
+    void* next_obj;
+
+    for(; slab; slab = next){
+        next = slab->remote_next;
+        obj = __atomic_exchange_n(&slab->remote_free, NULL, __ATOMIC_ACQUIRE);
+        for(; obj; obj = next_obj){
+            next_obj = *__free_link(cache, obj);
+            if(mag && mag->rounds < MAGAZINE_ROUNDS)
+                mag->objs[mag->rounds++] = obj;
+            else
+                __slab_put(slab, obj);
+            cc->remote_collected++;
+        }
+    }
+}
+
+/**
+ * ####################
+ *  MAGAZINE LAYER
+ * ####################
+ */
+
+/**
+ * Allocate from this CPU's loaded magazine, then its previous one, then trade the previous
+ * magazine for a full one from the depot. Only the depot exchange takes a lock, and it is
+ * paid once per MAGAZINE_ROUNDS objects. With no full magazine left, go to the slabs
+ */
+static void* __cache_alloc(kmem_cache_t* cache){
+    kmem_cpu_cache_t* cc = &cache->cpu[this_cpu()];
+    kmem_magazine_t* mag;
+
+    while(1){
+        if(cc->loaded && cc->loaded->rounds){
+            cc->hits++;
+            return cc->loaded->objs[--cc->loaded->rounds];
+        }
+        if(cc->previous && cc->previous->rounds){
+            mag = cc->loaded;
+            cc->loaded = cc->previous;
+            cc->previous = mag;
+            continue;
+        }
+        // objects other CPUs gave back come in one batch, under one lock
+        if(cc->remote_slabs){
+            spin_lock(&cache->lock);
+            __remote_collect(cache, cc, cc->loaded);
+            spin_unlock(&cache->lock);
+            continue;
+        }
+
+        spin_lock(&cache->depot_lock);
+        if(list_empty(&cache->depot_full)){
+            spin_unlock(&cache->depot_lock);
+            break;
+        }
+        if(cc->previous)
+            list_push_front(&cache->depot_empty, &cc->previous->elem);
+        cc->previous = cc->loaded;
+        cc->loaded = list_entry(list_pop_front(&cache->depot_full), kmem_magazine_t, elem);
+        cache->depot_exchanges++;
+        spin_unlock(&cache->depot_lock);
+    }
+
+    cc->misses++;
+    return __slab_alloc(cache);
+}
+
+/**
+ * Free into this CPU's loaded magazine, then its previous one, then trade the previous
+ * magazine for an empty one from the depot, making one when the depot has none.
+ * The object only goes back to its slab when no magazine can be had
+ */
+static void __cache_free(kmem_cache_t* cache, kmem_slab_t* slab, void* addr){
+    kmem_cpu_cache_t* cc = &cache->cpu[this_cpu()];
+    kmem_magazine_t* mag;
+
+    if(slab->owner != this_cpu()){
+        cc->remote_frees++;
+        __remote_free(slab, addr);
+        return;
+    }
+
+    while(1){
+        if(cc->loaded && cc->loaded->rounds < MAGAZINE_ROUNDS){
+            cc->hits++;
+            cc->loaded->objs[cc->loaded->rounds++] = addr;
+            return;
+        }
+        if(cc->previous && cc->previous->rounds < MAGAZINE_ROUNDS){
+            mag = cc->loaded;
+            cc->loaded = cc->previous;
+            cc->previous = mag;
+            continue;
+        }
+
+        spin_lock(&cache->depot_lock);
+        if(list_empty(&cache->depot_empty)){
+            spin_unlock(&cache->depot_lock);
+            // from the slab layer directly, a magazine must not need a magazine
+            if(!(mag = __slab_alloc(magazine_cache)))
+                break;
+            mag->rounds = 0;
+            magazine_cache->allocs++;
+            magazine_cache->requested += sizeof(kmem_magazine_t);
+            spin_lock(&cache->depot_lock);
+            list_push_front(&cache->depot_empty, &mag->elem);
+        }
+        if(cc->previous)
+            list_push_front(&cache->depot_full, &cc->previous->elem);
+        cc->previous = cc->loaded;
+        cc->loaded = list_entry(list_pop_front(&cache->depot_empty), kmem_magazine_t, elem);
+        cache->depot_exchanges++;
+        spin_unlock(&cache->depot_lock);
+    }
+
+    cc->misses++;
+    __slab_free(slab, addr);
+}
+
+/**
+ * Return the rounds of every full depot magazine to the slabs, then free the empty magazines.
+ * The shrinker may run from a slab grow on this very cache that found the buddy system empty,
+ * so a busy lock makes it skip the work instead of waiting. Magazines loaded on a CPU are left alone
+ */
+static void __depot_flush(kmem_cache_t* cache){
+    kmem_magazine_t* mag;
+    void* obj;
+
+    if(!spin_trylock(&cache->depot_lock))
+        return;
+    if(spin_trylock(&cache->lock)){
+        while(!list_empty(&cache->depot_full)){
+            mag = list_entry(list_pop_front(&cache->depot_full), kmem_magazine_t, elem);
+            while(mag->rounds){
+                obj = mag->objs[--mag->rounds];
+                __slab_put(__find_slab(obj), obj);
+            }
+            list_push_front(&cache->depot_empty, &mag->elem);
+        }
+        spin_unlock(&cache->lock);
+    }
+    if(spin_trylock(&magazine_cache->lock)){
+        while(!list_empty(&cache->depot_empty)){
+            mag = list_entry(list_pop_front(&cache->depot_empty), kmem_magazine_t, elem);
+            __slab_put(__find_slab(mag), mag);
+            magazine_cache->frees++;
+        }
+        spin_unlock(&magazine_cache->lock);
+    }
+    spin_unlock(&cache->depot_lock);
+}
+
+/* Hand this CPU's magazines to the depot, unless the shrinker runs in the middle of an operation on them */
+static void __cpu_flush(kmem_cache_t* cache){
+    kmem_cpu_cache_t* cc = &cache->cpu[this_cpu()];
+    kmem_magazine_t* mags[2] = {cc->loaded, cc->previous};
+    size_t i;
+
+    if(magazines_busy[this_cpu()] || !spin_trylock(&cache->depot_lock))
+        return;
+    for(i = 0; i < 2; i++){
+        if(mags[i])
+            list_push_front(mags[i]->rounds ? &cache->depot_full : &cache->depot_empty, &mags[i]->elem);
+    }
+    cc->loaded = NULL;
+    cc->previous = NULL;
+    spin_unlock(&cache->depot_lock);
+}
+
+/* Free every empty slab of a cache. Returns the pages released */
+static size_t __cache_shrink(kmem_cache_t* cache){
+    size_t i, released = 0;
+
+    if(!spin_trylock(&cache->lock))
+        return 0;
+    // pending remote frees may be all that keeps a slab in use
+    for(i = 0; i < MAX_CPUS; i++)
+        __remote_collect(cache, &cache->cpu[i], NULL);
+    while(!list_empty(&cache->slabs_empty)){
+        __slab_destroy(list_entry(list_pop_front(&cache->slabs_empty), kmem_slab_t, elem));
+        released += cache->slab_pages;
+        cache->reaped++;
+    }
+    spin_unlock(&cache->lock);
+    return released;
+}
+
+/* A cache whose descriptor comes straight from the slab layer, like the magazines */
+static kmem_cache_t* __cache_create(const char* name, size_t size, size_t align, kmem_ctor_t ctor){
+    kmem_cache_t* cache = __slab_alloc(&cache_cache);
+
+    if(!cache)
+        return NULL;
+    if(__cache_init(cache, name, size, align, ctor)){
+        __slab_free(*__slab_map_entry((uint64_t)cache >> PAGESHIFT, 0), cache);
         return NULL;
     }
+    cache_cache.allocs++;
+    cache_cache.requested += sizeof(kmem_cache_t);
+    return cache;
+}
+
+static void __slob_setup(){
+    size_t i, dir_pages;
 
-    // first free block
-    e = list_begin(&slob_lists[slob_size]);
-    slob_blk_t* blk = list_entry(e, slob_blk_t, elem);
-    list_remove(e);
+    // one directory entry per leaf, enough leaves for every frame the buddy can hand out
+    slab_map_leaves = (buddy_managed_frames() + SLAB_MAP_ENTRIES - 1) / SLAB_MAP_ENTRIES;
+    dir_pages = (slab_map_leaves * sizeof(kmem_slab_t**) + PAGESIZE - 1) / PAGESIZE;
+    if(!(slab_map = get_zeroed_block(dir_pages)))
+        HALT("[!] slob: Failed to alloc the slab page-frame table\n");
 
-    return (void*)blk;
+    list_init(&cache_list);
+    spin_lock_init(&cache_list_lock);
+    __cache_init(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), SLAB_CACHE_LINE, NULL);
+    for(i = 0; i < NUM_KMALLOC_CACHES; i++)
+        __cache_init(&kmalloc_caches[i], kmalloc_names[i], kmalloc_sizes[i], 0, NULL);
+    // magazines are written on every hot path operation, so they get cache lines of their own
+    if(!(magazine_cache = __cache_create("kmem_magazine", sizeof(kmem_magazine_t), SLAB_CACHE_LINE, NULL)))
+        HALT("[!] slob: Failed to create the magazine cache\n");
+    if(register_shrinker(slob_shrink))
+        HALT("[!] slob: Failed to register the slab shrinker\n");
+    slob_ready = 1;
 }
 
-static void __slob_free(void* addr){
-    slob_type_t stype;
-    slob_blk_t* blk = addr;
+/* Pages of the exact allocation behind a large object of size bytes */
+static inline size_t __large_pages(size_t size){
+    return (size + LARGE_HEADER_SIZE + PAGESIZE - 1) / PAGESIZE;
+}
+
+/* Header of a large object, halting if addr is not one */
+static kmalloc_large_t* __large_header(void* addr){
+    kmalloc_large_t* large = (kmalloc_large_t*)((char*)addr - LARGE_HEADER_SIZE);
 
-    if ( addr >= small_slob_bounds[0] && addr <= small_slob_bounds[1])
-        stype = SMALL;
-    if ( addr >= medium_slob_bounds[0] && addr <= medium_slob_bounds[1])
-        stype = MEDIUM;
-    if ( addr >= large_slob_bounds[0] && addr <= large_slob_bounds[1])
-        stype = LARGE;
+    if(((uint64_t)addr & (PAGESIZE - 1)) != LARGE_HEADER_SIZE || !get_block_pages(large))
+        HALT("[!] kfree(): pointer was not allocated by kmalloc!\n");
+    return large;
+}
 
-    blk->size = slob_sizes[stype];
+/* Requests past the size classes get exactly the pages they need, behind a header */
+static void* __large_alloc(size_t size){
+    kmalloc_large_t* large = get_block_exact(__large_pages(size));
 
-    // insert at end of appropriate list
-    list_insert(list_end(&slob_lists[stype]), &blk->elem);
+    if(!large)
+        return NULL;
+    large->pages = __large_pages(size);
+    large->size = size;
+    large_allocs++;
+    large_pages += large->pages;
+    return (char*)large + LARGE_HEADER_SIZE;
 }
 
+static void __large_free(kmalloc_large_t* large){
+    large_frees++;
+    large_pages -= large->pages;
+    free_block_exact(large, large->pages);
+}
+
+/* Set up the size classes. Slabs are only carved when a class runs out of objects */
+void slob_init(){
+    if(!slob_ready)
+        __slob_setup();
+}
+
+void slob_set_coloring(int enable){
+    slab_coloring = enable;
+}
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, kmem_ctor_t ctor){
+    if(!size)
+        return NULL;
+    if(!slob_ready)
+        __slob_setup();
+    return __cache_create(name, size, align, ctor);
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache){
+    void* obj;
+
+    magazines_busy[this_cpu()] = 1;
+    obj = __cache_alloc(cache);
+    magazines_busy[this_cpu()] = 0;
+    if(obj){
+        cache->allocs++;
+        cache->requested += cache->size;
+    }
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* obj){
+    kmem_slab_t* slab;
+
+    if(!obj)
+        return;
+    if(!(slab = __find_slab(obj)) || slab->cache != cache)
+        HALT("[!] kmem_cache_free(): object does not belong to the cache!\n");
+    __check_object(slab, obj);
+    cache->frees++;
+    magazines_busy[this_cpu()] = 1;
+    __cache_free(cache, slab, obj);
+    magazines_busy[this_cpu()] = 0;
+}
 
 //allocates memory through slab allocator.
 void *kmalloc(size_t size){
-    return __slob_alloc(size);
+    kmem_cache_t* cache;
+    void* addr;
+
+    if(!size)
+        return NULL;
+    if(size > KMALLOC_MAX_CACHE_SIZE)
+        return __large_alloc(size);
+    if(!slob_ready)
+        __slob_setup();
+
+    cache = __size_cache(size);
+    magazines_busy[this_cpu()] = 1;
+    addr = __cache_alloc(cache);
+    magazines_busy[this_cpu()] = 0;
+    if(addr){
+        cache->allocs++;
+        cache->requested += size;
+    }
+    return addr;
+}
+
+void *kzalloc(size_t size){
+    void* addr = kmalloc(size);
+
+    if(addr)
+        __zero(addr, size);
+    return addr;
 }
 
 //resize existing allocation.
 void * krealloc(void * addr, size_t size){
+    kmem_slab_t* slab;
+    kmalloc_large_t* large = NULL;
+    size_t old_size;
+    void* moved;
+
+    if(!addr)
+        return kmalloc(size);
+    if(!size){
+        kfree(addr);
+        return NULL;
+    }
+
+    if((slab = __find_slab(addr))){
+        // the object already holds anything up to its class size
+        old_size = slab->cache->size;
+        if(size <= old_size){
+            realloc_in_place++;
+            return addr;
+        }
+    }
+    else{
+        large = __large_header(addr);
+        old_size = large->size;
+        // large objects stay large, unless they shrink into the size classes
+        if(size > KMALLOC_MAX_CACHE_SIZE && !resize_block_exact(large, large->pages, __large_pages(size))){
+            large_pages += __large_pages(size) - large->pages;
+            large->pages = __large_pages(size);
+            large->size = size;
+            realloc_in_place++;
+            return addr;
+        }
+    }
+
+    if(!(moved = kmalloc(size)))
+        return NULL;
+    __copy(moved, addr, size < old_size ? size : old_size);
     kfree(addr);
-    return kmalloc(size);
+    realloc_moved++;
+    return moved;
 }
 
 //frees memory previously allocated.
 void kfree(void * addr){
-    __slob_free(addr);
+    kmem_slab_t* slab;
+
+    if(!addr)
+        return;
+    if((slab = __find_slab(addr))){
+        __check_object(slab, addr);
+        slab->cache->frees++;
+        magazines_busy[this_cpu()] = 1;
+        __cache_free(slab->cache, slab, addr);
+        magazines_busy[this_cpu()] = 0;
+    }
+    else
+        __large_free(__large_header(addr));
 }
 
 void kzfree(void * addr){
-    //TODO ZERO OUT
-    __slob_free(addr);
+    kmem_slab_t* slab;
+
+    if(!addr)
+        return;
+    if((slab = __find_slab(addr)))
+        __zero(addr, slab->cache->size);
+    else
+        __zero(addr, __large_header(addr)->size);
+    kfree(addr);
+}
+
+size_t slob_shrink(){
+    kmem_cache_t* cache;
+    list_elem_t* e;
+    size_t released = 0;
+
+    if(!slob_ready || !spin_trylock(&cache_list_lock))
+        return 0;
+    // magazines pin objects in otherwise empty slabs, and are slab objects themselves
+    for(e = list_begin(&cache_list); e != list_end(&cache_list); e = list_next(e)){
+        cache = list_entry(e, kmem_cache_t, elem);
+        __cpu_flush(cache);
+        __depot_flush(cache);
+    }
+    for(e = list_begin(&cache_list); e != list_end(&cache_list); e = list_next(e))
+        released += __cache_shrink(list_entry(e, kmem_cache_t, elem));
+    spin_unlock(&cache_list_lock);
+    return released;
 }
 
 void slob_list_counts(){
-    size_t i;
-    for(i = 0; i < 3; i++){
-        printf("Slob List #%d\n", i);
-        printf("List size: %d\n", list_size(&slob_lists[i]));
+    kmem_cache_t* cache;
+    list_elem_t* e;
+    size_t j, live, handed, hits, misses, remote, collected;
+
+    printf("[?] Slab caches: name, object size, live objects, slabs (pages each), internal fragmentation\n");
+    for(e = list_begin(&cache_list); slob_ready && e != list_end(&cache_list); e = list_next(e)){
+        cache = list_entry(e, kmem_cache_t, elem);
+        if(!cache->allocs && !cache->num_slabs)
+            continue;
+        live = cache->allocs - cache->frees;
+        handed = cache->allocs * cache->stride;
+        for(j = 0, hits = 0, misses = 0, remote = 0, collected = 0; j < MAX_CPUS; j++){
+            hits += cache->cpu[j].hits;
+            misses += cache->cpu[j].misses;
+            remote += cache->cpu[j].remote_frees;
+            collected += cache->cpu[j].remote_collected;
+        }
+        printf("\t%s: %d b, %d live, %d slabs (%d empty, %d reaped, %d pg, %d objects, %d colors), %d%% internal fragmentation\n",
+               cache->name, cache->size, live, cache->num_slabs, list_size(&cache->slabs_empty), cache->reaped,
+               cache->slab_pages, cache->num, cache->colors,
+               handed ? (handed - cache->requested) * 100 / handed : 0);
+        printf("\t\tmagazines: %d hits, %d misses, %d depot exchanges; %d remote frees, %d collected\n",
+               hits, misses, cache->depot_exchanges, remote, collected);
     }
+    printf("\tlarge: %d live, %d pg, %d freed\n", large_allocs - large_frees, large_pages, large_frees);
+    printf("\tkrealloc: %d in place, %d moved\n", realloc_in_place, realloc_moved);
 }
 
 void debug_slob_lists(){
-    size_t i;
+    kmem_cache_t* cache;
+    kmem_slab_t* slab;
+    list_elem_t* c;
     list_elem_t* e;
-    slob_blk_t *blk;
-    int counter = 0;
+    list_t* lists[3];
+    size_t j;
+
     printf("[?] Debugging slob list...\n");
-    for(i = 0; i < 3; i++){
-        counter = 0;
-        if(!list_empty(&slob_lists[i])){
-            printf("Slob List #%d\n", i);
-            printf("List size: %d\n", list_size(&slob_lists[i]));
-            //busy_loop();
-            for(e = list_begin(&slob_lists[i]); e != list_end(&slob_lists[i]); e = list_next(e)){
-                blk = list_entry(e, slob_blk_t, elem);
-                printf("slob_blk %d: %p -> size: %d\n", counter++, blk, blk->size);
+    for(c = list_begin(&cache_list); slob_ready && c != list_end(&cache_list); c = list_next(c)){
+        cache = list_entry(c, kmem_cache_t, elem);
+        if(!cache->num_slabs)
+            continue;
+        printf("%s: %d slabs, depot holds %d full and %d empty magazines\n", cache->name, cache->num_slabs,
+               list_size(&cache->depot_full), list_size(&cache->depot_empty));
+        lists[0] = &cache->slabs_full;
+        lists[1] = &cache->slabs_partial;
+        lists[2] = &cache->slabs_empty;
+        for(j = 0; j < 3; j++){
+            for(e = list_begin(lists[j]); e != list_end(lists[j]); e = list_next(e)){
+                slab = list_entry(e, kmem_slab_t, elem);
+                printf("slab %p: %d/%d objects in use\n", slab, slab->inuse, cache->num);
             }
         }
     }
@@ -10,6 +10,16 @@
 #define MALLOC(sz) mm_malloc(sz); SHOW_HEAP()
 #define FREE(ptr) mm_free(ptr); SHOW_HEAP()
 #define REALLOC(ptr, sz) mm_realloc(ptr, sz); SHOW_HEAP()
+#define FRAG_INDEX(order) __syscall1(5, order)
+
+#define POLICY_SLOTS 256
+#define POLICY_OPS 20000
+
+static inline uint64_t rdtsc(void){
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
 
 
 /*
@@ -31,12 +41,47 @@ void malloc_test(void){
     debug_heap_user();
 }
 
+/*
+ * Run the same mix of long-lived and short-lived allocations under every placement policy
+ */
+void policy_test(void){
+    static void* slots[POLICY_SLOTS];
+    uint64_t seed, start, cycles, i;
+
+    for(int policy = 0; policy < MM_NUM_POLICIES; policy++){
+        memlib_init(policy);
+        for(i = 0; i < POLICY_SLOTS; i++)
+            slots[i] = NULL;
+
+        seed = 1;
+        start = rdtsc();
+        for(int op = 0; op < POLICY_OPS; op++){
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            i = (seed >> 33) % POLICY_SLOTS;
+            // the first slots hold long-lived blocks that are rarely freed
+            if(!slots[i])
+                slots[i] = mm_malloc(16 + (seed >> 40) % ((seed >> 62) ? 256 : 4096));
+            else if(i >= POLICY_SLOTS / 8 || (seed >> 20) % 16 == 0){
+                mm_free(slots[i]);
+                slots[i] = NULL;
+            }
+        }
+        cycles = rdtsc() - start;
+
+        mm_print_stats();
+        __syscall2(3, (long)"\tcycles per operation: %d\n", cycles / POLICY_OPS);
+    }
+    memlib_init(MM_POLICY);
+}
+
 /*
  * Currently the user just evaluates the correctness of our malloc implementation
  */
 void user_start(void) {
     __syscall1(0, (long)"\n\n---USER---\n\n");
     malloc_test();
+    policy_test();
+    __syscall2(3, (long)"Fragmentation index of order 10: %d\n", FRAG_INDEX(10));
 
     __syscall1(0, (long)"Reached the end of the user program!\n");
     while(1){};
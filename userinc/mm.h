@@ -15,12 +15,30 @@ void mm_free(void *addr);
 #define min(a,b) a >= b ? b : a
 
 
-void memlib_init(void);
+/*placement policies for mm_malloc, all over the segregated free lists*/
+#define MM_FIRST_FIT 0 /*first block that fits, freed blocks go to the front of their list*/
+#define MM_NEXT_FIT 1 /*like first fit, but each search resumes where the last one stopped*/
+#define MM_BEST_FIT 2 /*lists kept sorted by size, so the first fit is the best fit*/
+#define MM_ADDRESS_ORDERED 3 /*lists kept sorted by address, first fit takes the lowest block*/
+#define MM_NUM_POLICIES 4
 
+/*policy used when mm_malloc initializes the heap itself*/
+#ifndef MM_POLICY
+#define MM_POLICY MM_FIRST_FIT
+#endif
 
+/*set up an empty heap placing blocks with the given policy; reuses the heap memory if there is one*/
+void memlib_init(int policy);
+
+/*print allocation counts, search cost and heap utilization since memlib_init*/
+void mm_print_stats(void);
+
+
+/*a block is |header||payload|, a free one also ends its payload with a copy of the header as footer*/
 typedef struct boundary_block{
     size_t free:1;
-    size_t size:63;
+    size_t prev_alloc:1; /*the block before is allocated, so it has no footer to read*/
+    size_t size:62; /*payload bytes after the header*/
 }boundary_block_t;
 
 /*call mem_sbrk to make the heap larger*/